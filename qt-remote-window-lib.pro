@@ -1,4 +1,4 @@
-QT += gui testlib network
+QT += gui testlib network concurrent
 
 TEMPLATE = lib
 CONFIG += staticlib
@@ -17,11 +17,23 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    remotewindowcodec.cpp \
+    remotewindowdecoder.cpp \
+    remotewindowencoder.cpp \
+    remotewindowhistogram.cpp \
+    remotewindowratecontroller.cpp \
     remotewindowserver.cpp \
+    remotewindowsharedmemory.cpp \
     remotewindowsocket.cpp
 
 HEADERS += \
+    remotewindowcodec.h \
+    remotewindowdecoder.h \
+    remotewindowencoder.h \
+    remotewindowhistogram.h \
+    remotewindowratecontroller.h \
     remotewindowserver.h \
+    remotewindowsharedmemory.h \
     remotewindowsocket.h
 
 # Default rules for deployment.
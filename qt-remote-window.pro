@@ -0,0 +1,15 @@
+TEMPLATE = subdirs
+
+# The library and everything built on it in one go. The library comes first, the rest links against it.
+SUBDIRS += \
+    lib \
+    remotewindowload \
+    benchmark
+
+lib.file = qt-remote-window-lib.pro
+
+remotewindowload.subdir = tools/remotewindowload
+remotewindowload.depends = lib
+
+benchmark.subdir = tests/benchmark
+benchmark.depends = lib
@@ -0,0 +1,603 @@
+#include "remotewindowcodec.h"
+#include <QBuffer>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+class ImageFormatCodec : public RemoteWindowCodec
+{
+public:
+    ImageFormatCodec(quint8 id, const char *format, bool lossy, bool zlib) :
+        RemoteWindowCodec(id),
+        format_(format),
+        lossy_(lossy),
+        zlib_(zlib)
+    {
+
+    }
+
+    virtual QByteArray encode(const QImage &image, double quality) const override
+    {
+        // The result is handed to the sockets and lives until sent, so it gets an exactly sized array of its own
+        const QByteArray &data = save(image, quality);
+        return zlib_ ? qCompress(data) : QByteArray(data.constData(), data.size());
+    }
+
+    virtual void encodeInto(const QImage &image, double quality, QByteArray &output) const override
+    {
+        // zlib only hands out arrays of its own, only the plain formats can be saved in place
+        if(zlib_) {
+            output = qCompress(save(image, quality));
+            return;
+        }
+
+        QBuffer buffer(&output);
+
+        output.reserve(output.capacity()); // Truncating a reserved array keeps its capacity
+        output.resize(0);
+        if(!buffer.open(QBuffer::WriteOnly) || !image.save(&buffer, format_, lossy_ ? static_cast<int>(quality * 100) : -1))
+            output.resize(0);
+    }
+
+    virtual QImage decode(const QByteArray &data) const override
+    {
+        return QImage::fromData(imageData(data), format_);
+    }
+
+    virtual QByteArray imageData(const QByteArray &data) const override
+    {
+        return zlib_ ? qUncompress(data) : data;
+    }
+
+private:
+    const QByteArray &save(const QImage &image, double quality) const
+    {
+        // Every encoder thread writes into its own scratch buffer, which keeps its capacity between frames.
+        // A buffer growing from empty for every frame would reallocate and copy a dozen times over.
+        thread_local QByteArray scratch;
+        QBuffer buffer(&scratch);
+
+        scratch.reserve(scratch.capacity()); // Truncating a reserved array keeps its capacity
+        scratch.resize(0);
+        if(!buffer.open(QBuffer::WriteOnly) || !image.save(&buffer, format_, lossy_ ? static_cast<int>(quality * 100) : -1))
+            scratch.resize(0);
+        return scratch;
+    }
+
+    const char *format_;
+    bool lossy_;
+    bool zlib_;
+};
+
+// Raw RGB32 pixels packed with an LZ4 block compatible compressor. Tuned for speed, not for ratio.
+class RawLz4Codec : public RemoteWindowCodec
+{
+public:
+    RawLz4Codec() :
+        RemoteWindowCodec(CI_RAW_LZ4)
+    {
+
+    }
+
+    virtual QByteArray encode(const QImage &image, double quality) const override
+    {
+        QByteArray data;
+
+        encodeInto(image, quality, data);
+        return data;
+    }
+
+    virtual void encodeInto(const QImage &image, double quality, QByteArray &output) const override
+    {
+        Q_UNUSED(quality);
+
+        QImage source = image.convertToFormat(QImage::Format_RGB32);
+        const int size = source.bytesPerLine() * source.height();
+        const int capacity = HEADER_SIZE + compressBound(size);
+
+        output.reserve(capacity); // Keeps the capacity when truncated to what was actually written
+        output.resize(capacity);
+
+        uchar *dst = reinterpret_cast<uchar *>(output.data());
+
+        qToBigEndian<quint32>(static_cast<quint32>(source.width()), dst);
+        qToBigEndian<quint32>(static_cast<quint32>(source.height()), dst + 4);
+
+        int compressed = compress(source.constBits(), size, dst + HEADER_SIZE);
+        output.resize(HEADER_SIZE + compressed);
+    }
+
+    virtual QImage decode(const QByteArray &data) const override
+    {
+        if(data.size() < HEADER_SIZE)
+            return QImage();
+
+        const uchar *src = reinterpret_cast<const uchar *>(data.constData());
+        const quint32 width = qFromBigEndian<quint32>(src);
+        const quint32 height = qFromBigEndian<quint32>(src + 4);
+
+        if(width > DIMENSION_MAX || height > DIMENSION_MAX)
+            return QImage();
+
+        QImage image(static_cast<int>(width), static_cast<int>(height), QImage::Format_RGB32);
+        if(image.isNull())
+            return QImage();
+
+        if(!decompress(src + HEADER_SIZE, data.size() - HEADER_SIZE, image.bits(), image.bytesPerLine() * image.height()))
+            return QImage();
+        return image;
+    }
+
+private:
+    static const int HEADER_SIZE = 8;
+    static const quint32 DIMENSION_MAX = 16384;
+    static const int MIN_MATCH = 4;
+    static const int LAST_LITERALS = 5;
+    static const int MATCH_FIND_LIMIT = 12;
+    static const int HASH_BITS = 14;
+    static const int OFFSET_MAX = 65535;
+
+    static int compressBound(int size)
+    {
+        return size + size / 255 + 16;
+    }
+
+    static quint32 read32(const uchar *p)
+    {
+        quint32 value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uchar *writeLength(uchar *op, int length)
+    {
+        for(; length >= 255; length -= 255)
+            *op++ = 255;
+        *op++ = static_cast<uchar>(length);
+        return op;
+    }
+
+    static uchar *writeSequence(uchar *op, const uchar *literals, int literalCount, int offset, int matchLength)
+    {
+        uchar *token = op++;
+        int matchCode = matchLength - MIN_MATCH;
+
+        *token = static_cast<uchar>(qMin(literalCount, 15) << 4);
+        if(literalCount >= 15)
+            op = writeLength(op, literalCount - 15);
+        memcpy(op, literals, static_cast<size_t>(literalCount));
+        op += literalCount;
+
+        if(matchLength > 0) {
+            *op++ = static_cast<uchar>(offset & 0xff);
+            *op++ = static_cast<uchar>(offset >> 8);
+            *token |= static_cast<uchar>(qMin(matchCode, 15));
+            if(matchCode >= 15)
+                op = writeLength(op, matchCode - 15);
+        }
+        return op;
+    }
+
+    static int compress(const uchar *src, int size, uchar *dst)
+    {
+        static const int TABLE_SIZE = 1 << HASH_BITS;
+        int table[TABLE_SIZE];
+        const uchar *ip = src;
+        const uchar *anchor = src;
+        const uchar *const end = src + size;
+        uchar *op = dst;
+
+        std::fill(table, table + TABLE_SIZE, -1);
+
+        if(size >= MATCH_FIND_LIMIT) {
+            const uchar *const matchLimit = end - LAST_LITERALS;
+            const uchar *const findLimit = end - MATCH_FIND_LIMIT;
+
+            while(ip < findLimit) {
+                const quint32 sequence = read32(ip);
+                const quint32 hash = (sequence * 2654435761U) >> (32 - HASH_BITS);
+                const int position = static_cast<int>(ip - src);
+                const int reference = table[hash];
+
+                table[hash] = position;
+                if(reference < 0 || position - reference > OFFSET_MAX || read32(src + reference) != sequence) {
+                    ip += 1 + ((ip - anchor) >> 6); // Skip faster through data that does not compress
+                    continue;
+                }
+
+                const uchar *match = src + reference;
+                const uchar *matchEnd = ip + MIN_MATCH;
+                for(const uchar *ref = match + MIN_MATCH; matchEnd < matchLimit && *matchEnd == *ref; ++ref)
+                    ++matchEnd;
+
+                op = writeSequence(op, anchor, static_cast<int>(ip - anchor), static_cast<int>(ip - match), static_cast<int>(matchEnd - ip));
+                ip = matchEnd;
+                anchor = ip;
+            }
+        }
+
+        op = writeSequence(op, anchor, static_cast<int>(end - anchor), 0, 0);
+        return static_cast<int>(op - dst);
+    }
+
+    static bool readLength(const uchar *&ip, const uchar *end, qint64 limit, int &length)
+    {
+        // Summed wide and bounded by the space there is, a run of 255 bytes from a hostile peer must not overflow
+        qint64 sum = length;
+        uchar byte;
+        do {
+            if(ip >= end)
+                return false;
+            byte = *ip++;
+            sum += byte;
+            if(sum > limit)
+                return false;
+        } while(255 == byte);
+        length = static_cast<int>(sum);
+        return true;
+    }
+
+    static bool decompress(const uchar *src, int size, uchar *dst, int dstSize)
+    {
+        const uchar *ip = src;
+        const uchar *const end = src + size;
+        uchar *op = dst;
+        uchar *const dstEnd = dst + dstSize;
+
+        while(ip < end) {
+            const uchar token = *ip++;
+            int literalCount = token >> 4;
+
+            if(15 == literalCount && !readLength(ip, end, qMin<qint64>(end - ip, dstEnd - op), literalCount))
+                return false;
+            if(literalCount < 0 || literalCount > end - ip || literalCount > dstEnd - op)
+                return false;
+            memcpy(op, ip, static_cast<size_t>(literalCount));
+            ip += literalCount;
+            op += literalCount;
+
+            if(ip >= end)
+                break; // Last sequence only carries literals
+
+            if(end - ip < 2)
+                return false;
+            const int offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if(0 == offset || offset > op - dst)
+                return false;
+
+            int matchLength = token & 0x0f;
+            if(15 == matchLength && !readLength(ip, end, dstEnd - op - MIN_MATCH, matchLength))
+                return false;
+            matchLength += MIN_MATCH;
+            if(matchLength < MIN_MATCH || matchLength > dstEnd - op)
+                return false;
+
+            const uchar *match = op - offset;
+            if(offset >= matchLength)
+                memcpy(op, match, static_cast<size_t>(matchLength));
+            else {
+                for(int i = 0; i < matchLength; ++i)
+                    op[i] = match[i]; // Overlapping copy repeats the pattern
+            }
+            op += matchLength;
+        }
+        return op == dstEnd;
+    }
+};
+
+// Lossless in the style of QOI: every pixel is a run, a recently seen color, a small difference to the previous
+// pixel or, as a last resort, the color itself. Flat UI content mostly ends up as runs and index hits. Not compatible
+// with QOI files, there is no alpha and the RGBA op is replaced by a long run instead.
+class QoiCodec : public RemoteWindowCodec
+{
+public:
+    QoiCodec() :
+        RemoteWindowCodec(CI_QOI)
+    {
+
+    }
+
+    virtual QByteArray encode(const QImage &image, double quality) const override
+    {
+        QByteArray data;
+
+        encodeInto(image, quality, data);
+        return data;
+    }
+
+    virtual void encodeInto(const QImage &image, double quality, QByteArray &output) const override
+    {
+        Q_UNUSED(quality);
+
+        const QImage source = image.convertToFormat(QImage::Format_RGB32);
+        const int width = source.width();
+        const int height = source.height();
+        const qint64 capacity = HEADER_SIZE + static_cast<qint64>(width) * height * 4 + 3; // No pixel takes more than 4 bytes
+
+        if(capacity > OUTPUT_MAX_SIZE) {
+            output.resize(0);
+            return;
+        }
+        output.reserve(static_cast<int>(capacity)); // Keeps the capacity when truncated to what was actually written
+        output.resize(static_cast<int>(capacity));
+
+        uchar *dst = reinterpret_cast<uchar *>(output.data());
+        uchar *op = dst + HEADER_SIZE;
+        quint32 index[INDEX_SIZE] = {};
+        quint32 previous = ALPHA_MASK;
+        int run = 0;
+
+        qToBigEndian<quint32>(static_cast<quint32>(width), dst);
+        qToBigEndian<quint32>(static_cast<quint32>(height), dst + 4);
+
+        for(int y = 0; y < height; ++y) {
+            const quint32 *line = reinterpret_cast<const quint32 *>(source.constScanLine(y));
+
+            for(int x = 0; x < width;) {
+                const quint32 pixel = line[x] | ALPHA_MASK;
+
+                // Take a whole run at once, a plain compare loop the compiler can vectorize. Runs continue on the next line.
+                if(pixel == previous) {
+                    int length = 1;
+                    while(x + length < width && (line[x + length] | ALPHA_MASK) == previous)
+                        ++length;
+                    run += length;
+                    x += length;
+                    continue;
+                }
+
+                op = writeRun(op, run);
+                run = 0;
+                op = writePixel(op, pixel, previous, index);
+                previous = pixel;
+                ++x;
+            }
+        }
+
+        op = writeRun(op, run);
+        output.resize(static_cast<int>(op - dst));
+    }
+
+    virtual QImage decode(const QByteArray &data) const override
+    {
+        if(data.size() < HEADER_SIZE)
+            return QImage();
+
+        const uchar *src = reinterpret_cast<const uchar *>(data.constData());
+        const quint32 width = qFromBigEndian<quint32>(src);
+        const quint32 height = qFromBigEndian<quint32>(src + 4);
+
+        if(width > DIMENSION_MAX || height > DIMENSION_MAX)
+            return QImage();
+
+        QImage image(static_cast<int>(width), static_cast<int>(height), QImage::Format_RGB32);
+        if(image.isNull())
+            return QImage();
+
+        // Scan lines of a 32 bit image are never padded, so the pixels can be filled as one array
+        const uchar *ip = src + HEADER_SIZE;
+        const uchar *const end = src + data.size();
+        quint32 *out = reinterpret_cast<quint32 *>(image.bits());
+        quint32 *const outEnd = out + width * height;
+        quint32 index[INDEX_SIZE] = {};
+        quint32 pixel = ALPHA_MASK;
+
+        while(out < outEnd) {
+            if(ip >= end)
+                return QImage();
+
+            const uchar byte = *ip++;
+            int length = 0;
+
+            if(OP_RGB == byte) {
+                if(end - ip < 3)
+                    return QImage();
+                pixel = ALPHA_MASK | (static_cast<quint32>(ip[0]) << 16) | (static_cast<quint32>(ip[1]) << 8) | ip[2];
+                ip += 3;
+            } else if(OP_LONG_RUN == byte) {
+                if(end - ip < 2)
+                    return QImage();
+                length = ((ip[0] << 8) | ip[1]) + 1;
+                ip += 2;
+            } else {
+                switch(byte & OP_MASK) {
+                    case OP_INDEX:
+                        pixel = index[byte & ~OP_MASK] | ALPHA_MASK;
+                        break;
+                    case OP_DIFF:
+                        pixel = addChannels(pixel, ((byte >> 4) & 0x03) - 2, ((byte >> 2) & 0x03) - 2, (byte & 0x03) - 2);
+                        break;
+                    case OP_LUMA: {
+                        if(ip >= end)
+                            return QImage();
+                        const int dg = (byte & ~OP_MASK) - 32;
+                        const uchar next = *ip++;
+                        pixel = addChannels(pixel, dg + (next >> 4) - 8, dg, dg + (next & 0x0f) - 8);
+                        break;
+                    }
+                    default:
+                        length = (byte & ~OP_MASK) + 1;
+                        break;
+                }
+            }
+
+            if(length > 0) {
+                if(length > outEnd - out)
+                    return QImage();
+                std::fill_n(out, length, pixel); // Vectorized, runs are where flat content spends its pixels
+                out += length;
+                continue;
+            }
+
+            index[pixelHash(pixel)] = pixel;
+            *out++ = pixel;
+        }
+        return ip == end ? image : QImage();
+    }
+
+private:
+    static const int HEADER_SIZE = 8;
+    static const quint32 DIMENSION_MAX = 16384;
+    static const qint64 OUTPUT_MAX_SIZE = (1 << 30) - 64; // Qt 5 byte arrays end just below 1 GiB, minus their own header
+    static const int INDEX_SIZE = 64;
+    static const int RUN_MAX = 62; // Run lengths of 63 and 64 would collide with the RGB and long run ops
+    static const int LONG_RUN_MAX = 65536;
+    static const quint32 ALPHA_MASK = 0xff000000;
+    static const uchar OP_INDEX = 0x00;
+    static const uchar OP_DIFF = 0x40;
+    static const uchar OP_LUMA = 0x80;
+    static const uchar OP_RUN = 0xc0;
+    static const uchar OP_RGB = 0xfe;
+    static const uchar OP_LONG_RUN = 0xff;
+    static const uchar OP_MASK = 0xc0;
+
+    static int pixelHash(quint32 pixel)
+    {
+        return static_cast<int>((((pixel >> 16) & 0xff) * 3 + ((pixel >> 8) & 0xff) * 5 + (pixel & 0xff) * 7 + 255 * 11) % INDEX_SIZE);
+    }
+
+    static int channelDiff(quint32 pixel, quint32 previous, int shift)
+    {
+        return static_cast<signed char>(static_cast<uchar>(pixel >> shift) - static_cast<uchar>(previous >> shift));
+    }
+
+    static quint32 addChannels(quint32 pixel, int dr, int dg, int db)
+    {
+        return ALPHA_MASK | (((pixel >> 16) + static_cast<quint32>(dr)) & 0xff) << 16
+                      | (((pixel >> 8) + static_cast<quint32>(dg)) & 0xff) << 8
+                      | ((pixel + static_cast<quint32>(db)) & 0xff);
+    }
+
+    static uchar *writeRun(uchar *op, int run)
+    {
+        while(run > RUN_MAX) {
+            const int length = run < LONG_RUN_MAX ? run : LONG_RUN_MAX;
+            *op++ = OP_LONG_RUN;
+            *op++ = static_cast<uchar>((length - 1) >> 8);
+            *op++ = static_cast<uchar>((length - 1) & 0xff);
+            run -= length;
+        }
+        if(run > 0)
+            *op++ = static_cast<uchar>(OP_RUN | (run - 1));
+        return op;
+    }
+
+    static uchar *writePixel(uchar *op, quint32 pixel, quint32 previous, quint32 *index)
+    {
+        const int hash = pixelHash(pixel);
+
+        if(index[hash] == pixel) {
+            *op++ = static_cast<uchar>(OP_INDEX | hash);
+            return op;
+        }
+        index[hash] = pixel;
+
+        const int dr = channelDiff(pixel, previous, 16);
+        const int dg = channelDiff(pixel, previous, 8);
+        const int db = channelDiff(pixel, previous, 0);
+        const int drg = dr - dg;
+        const int dbg = db - dg;
+
+        if(dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            *op++ = static_cast<uchar>(OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+        else if(dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+            *op++ = static_cast<uchar>(OP_LUMA | (dg + 32));
+            *op++ = static_cast<uchar>(((drg + 8) << 4) | (dbg + 8));
+        } else {
+            *op++ = OP_RGB;
+            *op++ = static_cast<uchar>(pixel >> 16);
+            *op++ = static_cast<uchar>(pixel >> 8);
+            *op++ = static_cast<uchar>(pixel);
+        }
+        return op;
+    }
+};
+
+QMap<quint8, RemoteWindowCodec *> &registry()
+{
+    static QMap<quint8, RemoteWindowCodec *> codecs;
+    return codecs;
+}
+
+QMutex &registryMutex()
+{
+    static QMutex mutex;
+    return mutex;
+}
+
+void registerBuiltInCodecs()
+{
+    QMap<quint8, RemoteWindowCodec *> &codecs = registry();
+
+    if(!codecs.isEmpty())
+        return;
+    codecs.insert(RemoteWindowCodec::CI_JPEG_ZLIB, new ImageFormatCodec(RemoteWindowCodec::CI_JPEG_ZLIB, "jpeg", true, true));
+    codecs.insert(RemoteWindowCodec::CI_JPEG, new ImageFormatCodec(RemoteWindowCodec::CI_JPEG, "jpeg", true, false));
+    codecs.insert(RemoteWindowCodec::CI_PNG, new ImageFormatCodec(RemoteWindowCodec::CI_PNG, "png", false, false));
+    codecs.insert(RemoteWindowCodec::CI_RAW_LZ4, new RawLz4Codec());
+    codecs.insert(RemoteWindowCodec::CI_QOI, new QoiCodec());
+}
+
+}
+
+RemoteWindowCodec::RemoteWindowCodec(quint8 id) :
+    id_(id)
+{
+
+}
+
+RemoteWindowCodec::~RemoteWindowCodec()
+{
+
+}
+
+const RemoteWindowCodec *RemoteWindowCodec::codec(quint8 id)
+{
+    QMutexLocker locker(&registryMutex());
+
+    registerBuiltInCodecs();
+    return registry().value(id, nullptr);
+}
+
+QList<quint8> RemoteWindowCodec::codecs()
+{
+    QMutexLocker locker(&registryMutex());
+
+    registerBuiltInCodecs();
+    return registry().keys();
+}
+
+bool RemoteWindowCodec::registerCodec(RemoteWindowCodec *codec)
+{
+    QMutexLocker locker(&registryMutex());
+
+    registerBuiltInCodecs();
+    if(nullptr == codec || codec->id() < CI_USER || registry().contains(codec->id()))
+        return false;
+
+    registry().insert(codec->id(), codec);
+    return true;
+}
+
+quint8 RemoteWindowCodec::id() const
+{
+    return id_;
+}
+
+void RemoteWindowCodec::encodeInto(const QImage &image, double quality, QByteArray &output) const
+{
+    output = encode(image, quality);
+}
+
+QByteArray RemoteWindowCodec::imageData(const QByteArray &data) const
+{
+    Q_UNUSED(data);
+    return QByteArray();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+
+class RemoteWindowCodec
+{
+    Q_DISABLE_COPY(RemoteWindowCodec)
+
+public:
+    enum CodecId
+    {
+        CI_JPEG_ZLIB    = 0, // Legacy peers only understand this one
+        CI_JPEG         = 1,
+        CI_PNG          = 2,
+        CI_RAW_LZ4      = 3,
+        CI_QOI          = 4, // Lossless, made for flat UI content and text
+
+        CI_USER         = 128,
+    };
+
+    RemoteWindowCodec(quint8 id);
+    virtual ~RemoteWindowCodec();
+
+    static const RemoteWindowCodec *codec(quint8 id);
+    static QList<quint8> codecs();
+    static bool registerCodec(RemoteWindowCodec *codec);
+
+    quint8 id() const;
+
+    virtual QByteArray encode(const QImage &image, double quality) const = 0;
+    virtual QImage decode(const QByteArray &data) const = 0;
+
+    // Encodes into the given array and reuses its capacity if nobody else holds on to it. The default
+    // goes through encode(), codecs that can write into the array directly override it.
+    virtual void encodeInto(const QImage &image, double quality, QByteArray &output) const;
+
+    // Returns the payload as image file data (loadable by QImage::fromData) or an empty array if the codec
+    // does not produce one. Used to keep the byte array based capture signal working.
+    virtual QByteArray imageData(const QByteArray &data) const;
+
+private:
+    quint8 id_;
+};
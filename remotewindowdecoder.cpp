@@ -0,0 +1,202 @@
+#include "remotewindowdecoder.h"
+#include "remotewindowcodec.h"
+#include <QMutexLocker>
+#include <QDataStream>
+#include <QPainter>
+#include <QtConcurrent>
+
+const int RemoteWindowDecoder::QUEUE_MAX_SIZE = 4; // Deltas can't be skipped, so allow a short burst before giving up on them
+const int RemoteWindowDecoder::DIMENSION_MAX = 16384; // In pixels, the same limit the codecs have
+
+RemoteWindowDecoder::RemoteWindowDecoder(QObject *parent) :
+    QThread(parent)
+{
+    droppedJobCount_ = 0;
+    awaitingKeyFrame_ = false;
+    resetPending_ = false;
+
+    qRegisterMetaType<RemoteWindowDecoder::Frame>();
+}
+
+RemoteWindowDecoder::~RemoteWindowDecoder()
+{
+    {
+        QMutexLocker locker(&mutex_);
+        requestInterruption();
+        condition_.wakeAll();
+    }
+    wait();
+}
+
+void RemoteWindowDecoder::submit(const Job &job)
+{
+    bool keyFrameRequired = false;
+
+    {
+        QMutexLocker locker(&mutex_);
+
+        if(JK_DELTA_TILES != job.kind) {
+            // A key frame replaces the whole image, whatever is still waiting to be decoded is stale
+            droppedJobCount_ += static_cast<quint64>(queue_.count());
+            queue_.clear();
+            awaitingKeyFrame_ = false;
+        } else if(awaitingKeyFrame_ || queue_.count() >= QUEUE_MAX_SIZE) {
+            // Deltas build on each other, once one is skipped the rest has to wait for the next key frame
+            droppedJobCount_ += static_cast<quint64>(queue_.count()) + 1;
+            queue_.clear();
+            keyFrameRequired = !awaitingKeyFrame_;
+            awaitingKeyFrame_ = true;
+        }
+
+        if(!awaitingKeyFrame_) {
+            queue_.enqueue(job);
+            condition_.wakeOne();
+        }
+    }
+
+    if(keyFrameRequired)
+        emit this->keyFrameRequired();
+    if(!isRunning())
+        start();
+}
+
+void RemoteWindowDecoder::reset()
+{
+    QMutexLocker locker(&mutex_);
+
+    queue_.clear();
+    awaitingKeyFrame_ = false;
+    resetPending_ = true;
+}
+
+quint64 RemoteWindowDecoder::droppedJobCount() const
+{
+    QMutexLocker locker(&mutex_);
+
+    return droppedJobCount_;
+}
+
+void RemoteWindowDecoder::run()
+{
+    forever {
+        Job job;
+
+        {
+            QMutexLocker locker(&mutex_);
+
+            while(queue_.isEmpty() && !isInterruptionRequested())
+                condition_.wait(&mutex_);
+            if(isInterruptionRequested())
+                return;
+
+            job = queue_.dequeue();
+            if(resetPending_) {
+                image_ = QImage();
+                resetPending_ = false;
+            }
+        }
+
+        Frame frame = decode(job);
+        if(!frame.image.isNull() || !frame.imageData.isEmpty())
+            emit frameDecoded(frame);
+    }
+}
+
+RemoteWindowDecoder::Frame RemoteWindowDecoder::decode(const Job &job)
+{
+    Frame frame;
+    const RemoteWindowCodec *codec = RemoteWindowCodec::codec(job.codec);
+
+    frame.sequence = job.sequence;
+    frame.captureTime = job.captureTime;
+    if(nullptr == codec)
+        return frame;
+
+    // A view instead of a copy, the job holds on to the payload for as long as it is decoded
+    const QByteArray payload = 0 == job.offset ? job.payload
+        : QByteArray::fromRawData(job.payload.constData() + job.offset, job.payload.size() - job.offset);
+
+    switch(job.kind) {
+        case JK_IMAGE:
+            frame.imageData = codec->imageData(payload);
+            if(frame.imageData.constData() == payload.constData() && job.offset > 0)
+                frame.imageData = job.payload.mid(job.offset); // Handed out, so it can't stay a view
+            if(job.decodeImage || frame.imageData.isEmpty()) {
+                QImage image = frame.imageData.isEmpty() ? codec->decode(payload) : QImage::fromData(frame.imageData);
+
+                if(!image.isNull()) {
+                    image_ = image.convertToFormat(QImage::Format_RGB32);
+                    frame.image = image_;
+                    frame.region = QRegion(image_.rect());
+                }
+            }
+            break;
+        case JK_KEY_TILES:
+        case JK_DELTA_TILES:
+            frame.region = decodeTiles(codec, payload, JK_KEY_TILES == job.kind);
+            if(!frame.region.isEmpty())
+                frame.image = image_;
+            break;
+    }
+    return frame;
+}
+
+QRegion RemoteWindowDecoder::decodeTiles(const RemoteWindowCodec *codec, const QByteArray &tiles, bool keyFrame)
+{
+    QSize size;
+    quint32 count = 0;
+    QDataStream stream(tiles);
+
+    stream >> size >> count;
+    if(QDataStream::Ok != stream.status())
+        return QRegion();
+    if(keyFrame) {
+        // The size comes from the peer, never allocate more than any codec would decode
+        image_ = QImage();
+        if(size.isEmpty() || size.width() > DIMENSION_MAX || size.height() > DIMENSION_MAX)
+            return QRegion();
+        image_ = QImage(size, QImage::Format_RGB32);
+        if(image_.isNull())
+            return QRegion();
+    } else if(image_.size() != size) {
+        // We missed the key frame this delta is based on
+        emit keyFrameRequired();
+        return QRegion();
+    }
+
+    // Tiles are independent of each other, decode them in parallel and only compose them here
+    QList<QRect> rects;
+    QList<QFuture<QImage>> futures;
+
+    for(quint32 i = 0; i < count; ++i) {
+        QRect rect;
+        QByteArray data;
+
+        stream >> rect >> data;
+        if(QDataStream::Ok != stream.status())
+            break;
+        if(!image_.rect().contains(rect))
+            continue;
+
+        rects.append(rect);
+        futures.append(QtConcurrent::run([codec, data]() {
+            return codec->decode(data);
+        }));
+    }
+
+    // The last frame handed out still shares the image, painting detaches it from that one
+    QRegion region;
+    QPainter painter(&image_);
+
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    for(int i = 0; i < rects.count(); ++i) {
+        QImage tile = futures[i].result();
+        if(tile.isNull())
+            continue;
+
+        painter.drawImage(rects.at(i).topLeft(), tile);
+        region += rects.at(i);
+    }
+    painter.end();
+    return region;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QImage>
+#include <QRegion>
+
+class RemoteWindowCodec;
+class RemoteWindowDecoder : public QThread
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(RemoteWindowDecoder)
+
+public:
+    enum JobKind
+    {
+        JK_IMAGE,
+        JK_KEY_TILES,
+        JK_DELTA_TILES,
+    };
+
+    struct Job
+    {
+        JobKind kind;
+        quint8 codec;
+        QByteArray payload;
+        int offset; // Where the frame data starts in the payload, anything in front of it was already read
+        bool decodeImage; // Plain images are only decoded if someone is interested in the result
+        quint32 sequence;
+        qint64 captureTime; // In us, on the sender's clock. Negative if the sender didn't tell
+    };
+
+    struct Frame
+    {
+        QImage image;
+        QRegion region;
+        QByteArray imageData; // Plain images only, as the byte array based capture signal expects it
+        quint32 sequence;
+        qint64 captureTime;
+    };
+
+    RemoteWindowDecoder(QObject *parent = nullptr);
+    virtual ~RemoteWindowDecoder() override;
+
+    void submit(const Job &job);
+    void reset();
+
+    quint64 droppedJobCount() const;
+
+private:
+    static const int QUEUE_MAX_SIZE;
+    static const int DIMENSION_MAX;
+
+    virtual void run() override;
+
+    Frame decode(const Job &job);
+    QRegion decodeTiles(const RemoteWindowCodec *codec, const QByteArray &tiles, bool keyFrame);
+
+    mutable QMutex mutex_;
+    QWaitCondition condition_;
+    QQueue<Job> queue_;
+    quint64 droppedJobCount_;
+    bool awaitingKeyFrame_;
+    bool resetPending_;
+
+    QImage image_; // Only touched by the decoder thread, the image deltas are composed on
+
+signals:
+    void frameDecoded(const RemoteWindowDecoder::Frame &frame);
+    void keyFrameRequired();
+};
+
+Q_DECLARE_METATYPE(RemoteWindowDecoder::Frame)
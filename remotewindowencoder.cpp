@@ -0,0 +1,447 @@
+#include "remotewindowencoder.h"
+#include "remotewindowcodec.h"
+#include <QMutexLocker>
+#include <QDataStream>
+#include <QtConcurrent>
+#include <QMap>
+#include <QElapsedTimer>
+#include <QtMath>
+#include <QPainter>
+#include <tuple>
+#include <cstring>
+
+const int RemoteWindowEncoder::QUEUE_MAX_SIZE = 2;
+const int RemoteWindowEncoder::TILE_SIZE = 64; // In pixels
+const int RemoteWindowEncoder::QUALITY_STEPS = 20; // Clients with about the same quality share one encode
+const int RemoteWindowEncoder::SCALE_STEPS = 16; // Clients with about the same viewport share one downscale and encode
+const int RemoteWindowEncoder::IMAGE_POOL_SIZE = 3; // The frame being encoded plus the delta references, with one to spare
+const int RemoteWindowEncoder::BUFFER_POOL_SIZE = 16; // Outputs of the frames still queued at the sockets, with some to spare
+
+bool RemoteWindowEncoder::Variant::operator<(const Variant &other) const
+{
+    return std::make_tuple(kind, codec, quality, size.width(), size.height(), reference)
+         < std::make_tuple(other.kind, other.codec, other.quality, other.size.width(), other.size.height(), other.reference);
+}
+
+RemoteWindowEncoder::RemoteWindowEncoder(QObject *parent) :
+    QThread(parent)
+{
+    droppedJobCount_ = 0;
+    unchangedFrameCount_ = 0;
+    encodedFrameCount_ = 0;
+    resetPending_ = false;
+    threadPool_.setMaxThreadCount(QThread::idealThreadCount());
+
+    qRegisterMetaType<RemoteWindowEncoder::Frame>();
+}
+
+RemoteWindowEncoder::~RemoteWindowEncoder()
+{
+    {
+        QMutexLocker locker(&mutex_);
+        requestInterruption();
+        condition_.wakeAll();
+    }
+    wait();
+}
+
+void RemoteWindowEncoder::submit(const Job &job)
+{
+    {
+        QMutexLocker locker(&mutex_);
+
+        // Drop the oldest job when the encoder falls behind, a stale frame is worth nothing
+        while(queue_.count() >= QUEUE_MAX_SIZE) {
+            queue_.dequeue();
+            droppedJobCount_++;
+        }
+        queue_.enqueue(job);
+        condition_.wakeOne();
+    }
+
+    if(!isRunning())
+        start();
+}
+
+void RemoteWindowEncoder::reset()
+{
+    QMutexLocker locker(&mutex_);
+
+    queue_.clear();
+    resetPending_ = true;
+}
+
+int RemoteWindowEncoder::threadCount() const
+{
+    return threadPool_.maxThreadCount();
+}
+
+void RemoteWindowEncoder::setThreadCount(int value)
+{
+    threadPool_.setMaxThreadCount(value > 0 ? value : QThread::idealThreadCount());
+}
+
+quint64 RemoteWindowEncoder::droppedJobCount() const
+{
+    QMutexLocker locker(&mutex_);
+
+    return droppedJobCount_;
+}
+
+quint64 RemoteWindowEncoder::unchangedFrameCount() const
+{
+    QMutexLocker locker(&mutex_);
+
+    return unchangedFrameCount_;
+}
+
+quint64 RemoteWindowEncoder::encodedFrameCount() const
+{
+    QMutexLocker locker(&mutex_);
+
+    return encodedFrameCount_;
+}
+
+RemoteWindowHistogram RemoteWindowEncoder::encodeTime() const
+{
+    QMutexLocker locker(&mutex_);
+
+    return encodeTime_;
+}
+
+RemoteWindowHistogram RemoteWindowEncoder::compressTime() const
+{
+    QMutexLocker locker(&mutex_);
+
+    return compressTime_;
+}
+
+void RemoteWindowEncoder::run()
+{
+    forever {
+        Job job;
+
+        {
+            QMutexLocker locker(&mutex_);
+
+            while(queue_.isEmpty() && !isInterruptionRequested())
+                condition_.wait(&mutex_);
+            if(isInterruptionRequested())
+                return;
+
+            job = queue_.dequeue();
+            if(resetPending_) {
+                references_.clear();
+                imageHashes_.clear();
+                imagePool_.clear();
+                bufferPool_.clear();
+                resetPending_ = false;
+            }
+        }
+
+        QElapsedTimer timer;
+        RemoteWindowHistogram compressTime;
+
+        timer.start();
+        Frame frame = encode(job, compressTime);
+
+        {
+            QMutexLocker locker(&mutex_);
+
+            encodeTime_.add(timer.nsecsElapsed() / 1000);
+            compressTime_.add(compressTime);
+            if(frame.outputs.isEmpty())
+                unchangedFrameCount_++;
+            else
+                encodedFrameCount_++;
+        }
+        if(!frame.outputs.isEmpty())
+            emit frameEncoded(frame);
+    }
+}
+
+RemoteWindowEncoder::Frame RemoteWindowEncoder::encode(const Job &job, RemoteWindowHistogram &compressTime)
+{
+    Frame frame;
+    QImage image = rgb32Image(job.image);
+    QMap<Variant, QByteArray> variants;
+    QMap<qint64, QList<QRect>> dirtyRectsCache;
+    QMap<qint64, QList<QRect>> bandRectsCache;
+    QMap<QPair<int, int>, QImage> scaledImages; // Every size is scaled once, the variants and references share it
+    const quint64 hash = imageHash(image);
+
+    frame.size = image.size();
+    frame.captureTime = job.captureTime;
+
+    for(QHash<quint32, QImage>::iterator it = references_.begin(); it != references_.end();) {
+        if(job.deltaClients.contains(it.key()))
+            ++it;
+        else
+            it = references_.erase(it);
+    }
+    for(QHash<quint32, quint64>::iterator it = imageHashes_.begin(); it != imageHashes_.end();) {
+        if(job.clients.contains(it.key()))
+            ++it;
+        else
+            it = imageHashes_.erase(it);
+    }
+
+    // Every variant is encoded once, no matter how many clients share it
+    for(const Target &target : job.targets) {
+        const RemoteWindowCodec *codec = RemoteWindowCodec::codec(target.codec);
+        if(nullptr == codec && FK_SHARED_FRAME != target.kind)
+            continue;
+
+        // A static window costs nothing but the hash, a pending key frame is always sent though
+        bool unchanged = imageHashes_.contains(target.client) && hash == imageHashes_.value(target.client);
+        if(unchanged && !target.keepAlive)
+            continue;
+
+        const QImage reference = references_.value(target.client);
+        Variant variant;
+
+        variant.kind = target.kind;
+        variant.codec = target.codec;
+        variant.quality = qRound(qBound(0.0, target.quality, 1.0) * QUALITY_STEPS);
+        variant.size = image.size();
+        variant.reference = 0;
+        if(FK_SHARED_FRAME == variant.kind) {
+            variant.codec = 0; // Raw pixels, every shared client gets the same slot. Scaling them would only cost time.
+            variant.quality = 0;
+        } else
+            variant.size = scaledSize(image.size(), target.viewportSize);
+
+        // Smooth scaling goes through Qt's vectorized box filter, much cheaper than encoding the pixels it saves
+        const QPair<int, int> sizeKey(variant.size.width(), variant.size.height());
+        if(variant.size != image.size() && !scaledImages.contains(sizeKey))
+            scaledImages.insert(sizeKey, image.scaled(variant.size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).convertToFormat(QImage::Format_RGB32));
+        const QImage scaled = variant.size == image.size() ? image : scaledImages.value(sizeKey);
+
+        if(FK_DELTA_FRAME == variant.kind) {
+            if(reference.size() == scaled.size())
+                variant.reference = reference.cacheKey();
+            else
+                variant.kind = FK_TILED_KEY_FRAME; // Deltas can't be made against a frame of a different size
+        }
+
+        if(!variants.contains(variant)) {
+            const double quality = static_cast<double>(variant.quality) / QUALITY_STEPS;
+            QElapsedTimer timer;
+            QByteArray data = takePooledBuffer();
+
+            timer.start();
+            switch(variant.kind) {
+                case FK_KEY_FRAME:
+                    codec->encodeInto(scaled, quality, data);
+                    break;
+                case FK_TILED_KEY_FRAME:
+                    if(!bandRectsCache.contains(scaled.cacheKey()))
+                        bandRectsCache.insert(scaled.cacheKey(), bandRects(scaled, job.bandHeight));
+                    encodeTiles(scaled, bandRectsCache.value(scaled.cacheKey()), codec, quality, data);
+                    break;
+                case FK_DELTA_FRAME:
+                    if(!dirtyRectsCache.contains(variant.reference))
+                        dirtyRectsCache.insert(variant.reference, dirtyRects(scaled, reference));
+                    encodeTiles(scaled, dirtyRectsCache.value(variant.reference), codec, quality, data);
+                    break;
+                case FK_SHARED_FRAME:
+                    data = sharedMemory_.write(image);
+                    break;
+            }
+            compressTime.add(timer.nsecsElapsed() / 1000);
+            if(FK_SHARED_FRAME != variant.kind)
+                returnPooledBuffer(data);
+            variants.insert(variant, data);
+        }
+
+        Output output;
+        output.kind = variant.kind;
+        output.size = variant.size;
+        output.data = variants.value(variant);
+        frame.outputs.insert(target.client, output);
+        imageHashes_.insert(target.client, hash);
+        if(job.deltaClients.contains(target.client) && FK_KEY_FRAME != variant.kind && FK_SHARED_FRAME != variant.kind)
+            references_.insert(target.client, scaled);
+    }
+
+    return frame;
+}
+
+quint64 RemoteWindowEncoder::imageHash(const QImage &image)
+{
+    // Four independent lanes so the multiplies don't wait on each other and the loop runs at memory
+    // speed, mixing as in xxHash64. Only used to tell two captures apart, not for anything security related.
+    static const quint64 PRIME_1 = Q_UINT64_C(0x9E3779B185EBCA87);
+    static const quint64 PRIME_2 = Q_UINT64_C(0xC2B2AE3D27D4EB4F);
+    static const quint64 PRIME_3 = Q_UINT64_C(0x165667B19E3779F9);
+    const uchar *data = image.constBits();
+    const size_t size = static_cast<size_t>(image.bytesPerLine()) * static_cast<size_t>(image.height());
+    quint64 lanes[4] = { PRIME_1 + PRIME_2, PRIME_2, 0, 0 - PRIME_1 };
+    size_t offset = 0;
+
+    for(; offset + sizeof(lanes) <= size; offset += sizeof(lanes)) {
+        quint64 words[4];
+
+        memcpy(words, data + offset, sizeof(words));
+        for(int i = 0; i < 4; ++i) {
+            lanes[i] += words[i] * PRIME_2;
+            lanes[i] = (lanes[i] << 31) | (lanes[i] >> 33);
+            lanes[i] *= PRIME_1;
+        }
+    }
+
+    quint64 hash = ((lanes[0] << 1) | (lanes[0] >> 63)) + ((lanes[1] << 7) | (lanes[1] >> 57))
+                 + ((lanes[2] << 12) | (lanes[2] >> 52)) + ((lanes[3] << 18) | (lanes[3] >> 46));
+
+    hash += static_cast<quint64>(size) ^ (static_cast<quint64>(image.width()) << 32);
+    for(; offset < size; ++offset) {
+        hash ^= data[offset] * PRIME_3;
+        hash = ((hash << 11) | (hash >> 53)) * PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+QSize RemoteWindowEncoder::scaledSize(const QSize &size, const QSize &viewportSize)
+{
+    // Fit the frame in the viewport, never scale it up. The factor is rounded up to a step so viewers
+    // with about the same viewport get the same size and with that the same encode.
+    if(viewportSize.isEmpty() || size.isEmpty())
+        return size;
+
+    const double factor = qMin(static_cast<double>(viewportSize.width()) / size.width(), static_cast<double>(viewportSize.height()) / size.height());
+    const int steps = qCeil(factor * SCALE_STEPS);
+    if(steps >= SCALE_STEPS)
+        return size;
+    return QSize(qMax(1, size.width() * steps / SCALE_STEPS), qMax(1, size.height() * steps / SCALE_STEPS));
+}
+
+QList<QRect> RemoteWindowEncoder::dirtyRects(const QImage &image, const QImage &reference) const
+{
+    // Compare the frame tile by tile against the reference, horizontally adjacent dirty tiles
+    // are merged into a single rect to keep the per tile encoding overhead down.
+    QList<QRect> rects;
+    const int bytesPerPixel = 4;
+
+    for(int y = 0; y < image.height(); y += TILE_SIZE) {
+        const int tileHeight = qMin(TILE_SIZE, image.height() - y);
+        QRect run;
+
+        for(int x = 0; x < image.width(); x += TILE_SIZE) {
+            const int tileWidth = qMin(TILE_SIZE, image.width() - x);
+            bool dirty = false;
+
+            for(int line = y; !dirty && line < y + tileHeight; ++line) {
+                dirty = 0 != memcmp(image.constScanLine(line) + x * bytesPerPixel,
+                                    reference.constScanLine(line) + x * bytesPerPixel,
+                                    static_cast<size_t>(tileWidth * bytesPerPixel));
+            }
+
+            QRect tile(x, y, tileWidth, tileHeight);
+            if(dirty)
+                run = run.isNull() ? tile : run.united(tile);
+            else if(!run.isNull()) {
+                rects.append(run);
+                run = QRect();
+            }
+        }
+        if(!run.isNull())
+            rects.append(run);
+    }
+    return rects;
+}
+
+QList<QRect> RemoteWindowEncoder::bandRects(const QImage &image, int bandHeight) const
+{
+    QList<QRect> rects;
+
+    bandHeight = qMax(bandHeight, TILE_SIZE);
+    for(int y = 0; y < image.height(); y += bandHeight)
+        rects.append(QRect(0, y, image.width(), qMin(bandHeight, image.height() - y)));
+    return rects;
+}
+
+void RemoteWindowEncoder::encodeTiles(const QImage &image, const QList<QRect> &rects, const RemoteWindowCodec *codec, double quality, QByteArray &tiles)
+{
+    // Every tile is encoded independently, so they are spread over the pool and can be decoded in parallel too.
+    // Each worker writes into a tile buffer of its own, which keeps its capacity from frame to frame.
+    QList<QFuture<void>> futures;
+
+    if(tileBuffers_.count() < rects.count())
+        tileBuffers_.resize(rects.count());
+    for(int i = 0; i < rects.count(); ++i) {
+        QByteArray *buffer = &tileBuffers_[i];
+        const QRect rect = rects.at(i);
+
+        futures.append(QtConcurrent::run(&threadPool_, [image, rect, codec, quality, buffer]() {
+            codec->encodeInto(image.copy(rect), quality, *buffer);
+        }));
+    }
+    for(QFuture<void> &future : futures)
+        future.waitForFinished();
+
+    tiles.reserve(tiles.capacity()); // Truncating a reserved array keeps its capacity
+    tiles.resize(0);
+
+    QDataStream stream(&tiles, QIODevice::WriteOnly);
+
+    stream << image.size() << static_cast<quint32>(rects.count());
+    for(int i = 0; i < rects.count(); ++i)
+        stream << rects.at(i) << tileBuffers_.at(i);
+}
+
+QImage RemoteWindowEncoder::rgb32Image(const QImage &image)
+{
+    // Captures in another format are converted here instead of on the GUI thread, into a pooled image
+    if(QImage::Format_RGB32 == image.format())
+        return image;
+
+    QImage converted = takePooledImage(image.size());
+    QPainter painter(&converted);
+
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.drawImage(QRect(QPoint(0, 0), image.size()), image); // In pixels, whatever the device pixel ratio
+    painter.end();
+    returnPooledImage(converted);
+    return converted;
+}
+
+QImage RemoteWindowEncoder::takePooledImage(const QSize &size)
+{
+    // Free once the only reference left is the pool's own
+    for(int i = 0; i < imagePool_.count(); ++i) {
+        if(imagePool_.at(i).size() == size && imagePool_.at(i).isDetached())
+            return imagePool_.takeAt(i);
+    }
+    return QImage(size, QImage::Format_RGB32);
+}
+
+void RemoteWindowEncoder::returnPooledImage(const QImage &image)
+{
+    // The oldest go first, so images of a size the window no longer has age out
+    while(imagePool_.count() >= IMAGE_POOL_SIZE)
+        imagePool_.removeFirst();
+    imagePool_.append(image);
+}
+
+QByteArray RemoteWindowEncoder::takePooledBuffer()
+{
+    // Free once every socket has written it out and let go of it, the pool holds the only reference left
+    for(int i = 0; i < bufferPool_.count(); ++i) {
+        if(bufferPool_.at(i).isDetached())
+            return bufferPool_.takeAt(i);
+    }
+    return QByteArray();
+}
+
+void RemoteWindowEncoder::returnPooledBuffer(const QByteArray &buffer)
+{
+    while(bufferPool_.count() >= BUFFER_POOL_SIZE)
+        bufferPool_.removeFirst();
+    bufferPool_.append(buffer);
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "remotewindowhistogram.h"
+#include "remotewindowsharedmemory.h"
+#include <QThread>
+#include <QMutex>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QImage>
+#include <QHash>
+#include <QVector>
+#include <QSet>
+
+class RemoteWindowCodec;
+class RemoteWindowEncoder : public QThread
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(RemoteWindowEncoder)
+
+public:
+    enum FrameKind
+    {
+        FK_KEY_FRAME,
+        FK_TILED_KEY_FRAME,
+        FK_DELTA_FRAME,
+        FK_SHARED_FRAME, // Raw pixels in shared memory, the output is only the notification
+    };
+
+    struct Target
+    {
+        quint32 client;
+        quint8 codec;
+        double quality;
+        FrameKind kind;
+        bool keepAlive; // Encode even if the client already has this exact image
+        QSize viewportSize; // Frames are scaled down to fit, invalid to always send them at full size
+    };
+
+    struct Job
+    {
+        QImage image;
+        QList<Target> targets;
+        QSet<quint32> clients; // Every client still connected, whether it is a target or not
+        QSet<quint32> deltaClients;
+        int bandHeight;
+        qint64 captureTime; // In us, passed on with the frame
+    };
+
+    struct Output
+    {
+        FrameKind kind;
+        QSize size; // Of the image sent, smaller than the frame if it was scaled down
+        QByteArray data;
+    };
+
+    struct Frame
+    {
+        QSize size;
+        qint64 captureTime;
+        QHash<quint32, Output> outputs;
+    };
+
+    RemoteWindowEncoder(QObject *parent = nullptr);
+    virtual ~RemoteWindowEncoder() override;
+
+    void submit(const Job &job);
+    void reset();
+
+    int threadCount() const;
+    void setThreadCount(int value);
+
+    quint64 droppedJobCount() const;
+    quint64 unchangedFrameCount() const;
+    quint64 encodedFrameCount() const;
+    RemoteWindowHistogram encodeTime() const; // In us, per job
+    RemoteWindowHistogram compressTime() const; // In us, per variant that went through a codec
+
+private:
+    static const int QUEUE_MAX_SIZE;
+    static const int TILE_SIZE;
+    static const int QUALITY_STEPS;
+    static const int SCALE_STEPS;
+    static const int IMAGE_POOL_SIZE;
+    static const int BUFFER_POOL_SIZE;
+
+    struct Variant
+    {
+        FrameKind kind;
+        quint8 codec;
+        int quality;
+        QSize size;
+        qint64 reference;
+
+        bool operator<(const Variant &other) const;
+    };
+
+    virtual void run() override;
+
+    static quint64 imageHash(const QImage &image);
+    static QSize scaledSize(const QSize &size, const QSize &viewportSize);
+
+    Frame encode(const Job &job, RemoteWindowHistogram &compressTime);
+    QList<QRect> dirtyRects(const QImage &image, const QImage &reference) const;
+    QList<QRect> bandRects(const QImage &image, int bandHeight) const;
+    void encodeTiles(const QImage &image, const QList<QRect> &rects, const RemoteWindowCodec *codec, double quality, QByteArray &tiles);
+    QImage rgb32Image(const QImage &image);
+    QImage takePooledImage(const QSize &size);
+    void returnPooledImage(const QImage &image);
+    QByteArray takePooledBuffer();
+    void returnPooledBuffer(const QByteArray &buffer);
+
+    mutable QMutex mutex_;
+    QWaitCondition condition_;
+    QQueue<Job> queue_;
+    QThreadPool threadPool_;
+    quint64 droppedJobCount_;
+    quint64 unchangedFrameCount_;
+    quint64 encodedFrameCount_;
+    RemoteWindowHistogram encodeTime_;
+    RemoteWindowHistogram compressTime_;
+    bool resetPending_;
+
+    // Only touched by the encoder thread. The last image each delta client was sent, clients that are
+    // in step share the same implicitly shared image, so this costs next to nothing in that case.
+    QHash<quint32, QImage> references_;
+    QHash<quint32, quint64> imageHashes_; // Hash of the last image each client was sent
+    QList<QImage> imagePool_; // Conversion targets for captures not in RGB32
+    QList<QByteArray> bufferPool_; // Outputs, back in service once every socket has written them out
+    QVector<QByteArray> tileBuffers_; // One per tile, only ever referenced here
+    RemoteWindowSharedMemory sharedMemory_;
+
+signals:
+    void frameEncoded(const RemoteWindowEncoder::Frame &frame);
+};
+
+Q_DECLARE_METATYPE(RemoteWindowEncoder::Frame)
@@ -0,0 +1,102 @@
+#include "remotewindowhistogram.h"
+#include <QtAlgorithms>
+#include <QJsonArray>
+#include <cstring>
+
+RemoteWindowHistogram::RemoteWindowHistogram()
+{
+    reset();
+}
+
+void RemoteWindowHistogram::add(qint64 value)
+{
+    value = qMax<qint64>(value, 0);
+
+    const int index = 64 - static_cast<int>(qCountLeadingZeroBits(static_cast<quint64>(value)));
+    buckets_[qMin(index, BUCKET_COUNT - 1)]++;
+    count_++;
+    sum_ += value;
+    max_ = qMax(max_, value);
+}
+
+void RemoteWindowHistogram::add(const RemoteWindowHistogram &other)
+{
+    for(int i = 0; i < BUCKET_COUNT; ++i)
+        buckets_[i] += other.buckets_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = qMax(max_, other.max_);
+}
+
+void RemoteWindowHistogram::reset()
+{
+    memset(buckets_, 0, sizeof(buckets_));
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+quint64 RemoteWindowHistogram::count() const
+{
+    return count_;
+}
+
+qint64 RemoteWindowHistogram::sum() const
+{
+    return sum_;
+}
+
+qint64 RemoteWindowHistogram::max() const
+{
+    return max_;
+}
+
+qint64 RemoteWindowHistogram::mean() const
+{
+    return count_ > 0 ? sum_ / static_cast<qint64>(count_) : 0;
+}
+
+qint64 RemoteWindowHistogram::percentile(double p) const
+{
+    const quint64 rank = static_cast<quint64>(qBound(0.0, p, 1.0) * static_cast<double>(count_));
+    quint64 seen = 0;
+
+    for(int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets_[i];
+        if(seen > rank || (seen == count_ && seen > 0))
+            return qMin(bucketUpperBound(i), max_);
+    }
+    return 0;
+}
+
+quint64 RemoteWindowHistogram::bucket(int index) const
+{
+    return index >= 0 && index < BUCKET_COUNT ? buckets_[index] : 0;
+}
+
+qint64 RemoteWindowHistogram::bucketUpperBound(int index)
+{
+    return Q_INT64_C(1) << qBound(0, index, 62);
+}
+
+QJsonObject RemoteWindowHistogram::toJson() const
+{
+    // Trailing empty buckets are left out, they only make the output harder to read
+    QJsonObject json;
+    QJsonArray buckets;
+    int last = BUCKET_COUNT - 1;
+
+    while(last >= 0 && 0 == buckets_[last])
+        last--;
+    for(int i = 0; i <= last; ++i)
+        buckets.append(static_cast<qint64>(buckets_[i]));
+
+    json["count"] = static_cast<qint64>(count_);
+    json["mean"] = mean();
+    json["p50"] = percentile(0.5);
+    json["p90"] = percentile(0.9);
+    json["p99"] = percentile(0.99);
+    json["max"] = max_;
+    json["buckets"] = buckets;
+    return json;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <QtGlobal>
+#include <QJsonObject>
+
+// Power of two buckets, so adding a sample is a couple of instructions and the histogram can stay on in production
+class RemoteWindowHistogram
+{
+public:
+    static const int BUCKET_COUNT = 32;
+
+    RemoteWindowHistogram();
+
+    void add(qint64 value);
+    void add(const RemoteWindowHistogram &other);
+    void reset();
+
+    quint64 count() const;
+    qint64 sum() const;
+    qint64 max() const;
+    qint64 mean() const;
+    qint64 percentile(double p) const; // Upper bound of the bucket the percentile falls in, p in [0, 1]
+
+    quint64 bucket(int index) const;
+    static qint64 bucketUpperBound(int index); // Bucket n holds values below 2^n
+
+    QJsonObject toJson() const;
+
+private:
+    quint64 buckets_[BUCKET_COUNT];
+    quint64 count_;
+    qint64 sum_;
+    qint64 max_;
+};
@@ -0,0 +1,93 @@
+#include "remotewindowratecontroller.h"
+
+const double RemoteWindowRateController::QUALITY_DECREASE_FACTOR = 0.8;
+const double RemoteWindowRateController::QUALITY_INCREASE_STEP = 0.05;
+const int RemoteWindowRateController::FRAME_INTERVAL_INCREASE_PERCENTAGE = 50;
+const int RemoteWindowRateController::FRAME_INTERVAL_DECREASE_PERCENTAGE = 20;
+const int RemoteWindowRateController::DECREASE_HOLD_UPDATES = 3; // Give a decrease time to show its effect
+const int RemoteWindowRateController::INCREASE_AFTER_UPDATES = 10;
+
+RemoteWindowRateController::RemoteWindowRateController()
+{
+    quality_ = 1.0;
+    qualityMin_ = 0.0;
+    qualityMax_ = 1.0;
+    frameInterval_ = 0;
+    frameIntervalMin_ = 0;
+    frameIntervalMax_ = 0;
+    targetLatency_ = 0;
+    holdUpdates_ = 0;
+    goodUpdates_ = 0;
+}
+
+double RemoteWindowRateController::quality() const
+{
+    return quality_;
+}
+
+void RemoteWindowRateController::setQualityRange(double min, double max)
+{
+    qualityMax_ = qBound(0.0, max, 1.0);
+    qualityMin_ = qBound(0.0, min, qualityMax_);
+    quality_ = qBound(qualityMin_, quality_, qualityMax_);
+}
+
+int RemoteWindowRateController::frameInterval() const
+{
+    return frameInterval_;
+}
+
+void RemoteWindowRateController::setFrameIntervalRange(int min, int max)
+{
+    frameIntervalMin_ = qMax(min, 0);
+    frameIntervalMax_ = qMax(max, frameIntervalMin_);
+    frameInterval_ = qBound(frameIntervalMin_, frameInterval_, frameIntervalMax_);
+}
+
+int RemoteWindowRateController::targetLatency() const
+{
+    return targetLatency_;
+}
+
+void RemoteWindowRateController::setTargetLatency(int value)
+{
+    targetLatency_ = qMax(value, 0);
+}
+
+void RemoteWindowRateController::update(qint64 latency)
+{
+    // Multiplicative decrease, additive increase. Quality is given up first and won back last,
+    // a smooth picture at a lower quality beats a sharp one that lags behind.
+    if(holdUpdates_ > 0)
+        holdUpdates_--;
+
+    if(latency > targetLatency_) {
+        goodUpdates_ = 0;
+        if(holdUpdates_ > 0)
+            return;
+
+        if(quality_ > qualityMin_)
+            quality_ = qMax(qualityMin_, quality_ * QUALITY_DECREASE_FACTOR);
+        else
+            frameInterval_ = qMin(frameIntervalMax_, frameInterval_ + qMax(1, frameInterval_ * FRAME_INTERVAL_INCREASE_PERCENTAGE / 100));
+        holdUpdates_ = DECREASE_HOLD_UPDATES;
+    } else if(latency < targetLatency_ / 2) {
+        if(++goodUpdates_ < INCREASE_AFTER_UPDATES)
+            return;
+
+        goodUpdates_ = 0;
+        if(frameInterval_ > frameIntervalMin_)
+            frameInterval_ = qMax(frameIntervalMin_, frameInterval_ - qMax(1, frameInterval_ * FRAME_INTERVAL_DECREASE_PERCENTAGE / 100));
+        else
+            quality_ = qMin(qualityMax_, quality_ + QUALITY_INCREASE_STEP);
+    } else
+        goodUpdates_ = 0;
+}
+
+void RemoteWindowRateController::reset()
+{
+    quality_ = qualityMax_;
+    frameInterval_ = frameIntervalMin_;
+    holdUpdates_ = 0;
+    goodUpdates_ = 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <QtGlobal>
+
+class RemoteWindowRateController
+{
+public:
+    RemoteWindowRateController();
+
+    double quality() const;
+    void setQualityRange(double min, double max);
+
+    int frameInterval() const;
+    void setFrameIntervalRange(int min, int max);
+
+    int targetLatency() const;
+    void setTargetLatency(int value);
+
+    void update(qint64 latency);
+    void reset();
+
+private:
+    static const double QUALITY_DECREASE_FACTOR;
+    static const double QUALITY_INCREASE_STEP;
+    static const int FRAME_INTERVAL_INCREASE_PERCENTAGE;
+    static const int FRAME_INTERVAL_DECREASE_PERCENTAGE;
+    static const int DECREASE_HOLD_UPDATES;
+    static const int INCREASE_AFTER_UPDATES;
+
+    double quality_;
+    double qualityMin_;
+    double qualityMax_;
+    int frameInterval_;
+    int frameIntervalMin_;
+    int frameIntervalMax_;
+    int targetLatency_;
+    int holdUpdates_;
+    int goodUpdates_;
+};
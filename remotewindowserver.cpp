@@ -1,35 +1,87 @@
 #include "remotewindowserver.h"
 #include "remotewindowsocket.h"
+#include "remotewindowcodec.h"
 #include <QWindow>
-#include <QWindow>
+#include <QMetaObject>
+#include <QMetaMethod>
+#include <QJsonArray>
 #include <QScreen>
-#include <QBuffer>
+#include <QThread>
 #include <QTest>
 
 const double RemoteWindowServer::QUALITY_DEFAULT = 0.3; // between 0.0 and 1.0
+const double RemoteWindowServer::MINIMUM_QUALITY_DEFAULT = 0.1; // between 0.0 and 1.0
+const int RemoteWindowServer::MAXIMUM_WINDOW_UPDATE_DELAY_DEFAULT = 500; // In ms
+const int RemoteWindowServer::TARGET_LATENCY_DEFAULT = 150; // In ms
+const int RemoteWindowServer::KEEP_ALIVE_INTERVAL_DEFAULT = 1000; // In ms
 const int RemoteWindowServer::WINDOW_UPDATE_DELAY_MIN = 5; // In ms
 const int RemoteWindowServer::WINDOW_UPDATE_DELAY_DEFAULT = 25; // In ms
+const int RemoteWindowServer::BAND_HEIGHT_MIN = 64; // In pixels
+const int RemoteWindowServer::BAND_HEIGHT_DEFAULT = 128; // In pixels
+const qint64 RemoteWindowServer::WRITE_BUFFER_THRESHOLD_DEFAULT = 1024 * 64; // In bytes
+const int RemoteWindowServer::METRICS_INTERVAL_DEFAULT = 1000; // In ms
+const int RemoteWindowServer::IMAGE_POOL_SIZE = 6; // Queued and encoding jobs plus delta references, with one to spare
 
 RemoteWindowServer::RemoteWindowServer(QObject *parent, unsigned short port) :
     QTcpServer(parent)
 {
     window_ = nullptr;
     screenShotFunction_ = nullptr;
+    imageCaptureFunction_ = nullptr;
     quality_ = QUALITY_DEFAULT;
+    adaptive_ = true;
+    minimumQuality_ = MINIMUM_QUALITY_DEFAULT;
+    maximumWindowUpdateDelay_ = MAXIMUM_WINDOW_UPDATE_DELAY_DEFAULT;
+    targetLatency_ = TARGET_LATENCY_DEFAULT;
+    keepAliveInterval_ = KEEP_ALIVE_INTERVAL_DEFAULT;
+    deltaFrames_ = true;
+    bandHeight_ = BAND_HEIGHT_DEFAULT;
+    writeBufferThreshold_ = WRITE_BUFFER_THRESHOLD_DEFAULT;
+    ioThreadCount_ = 0;
+    nextIoThread_ = 0;
     windowUpdateDelayTimerId_ = -1;
     windowUpdateDelay_ = WINDOW_UPDATE_DELAY_DEFAULT;
+    captureMode_ = CM_TIMER;
+    damageTimerId_ = -1;
+    damageTime_ = -1;
+    lastCaptureTime_ = -1;
+    capturedFrameCount_ = 0;
+    metricsInterval_ = METRICS_INTERVAL_DEFAULT;
+    metricsTimerId_ = -1;
+    lastMetricsTime_ = 0;
+    lastCapturedFrameCount_ = 0;
+    lastEncodedFrameCount_ = 0;
+    captureRate_ = 0.0;
+    frameRate_ = 0.0;
     port_ = port;
+    nextClientId_ = 0;
+    encoder_ = new RemoteWindowEncoder(this);
+    clock_.start();
+    startMetricsTimer();
+
+    qRegisterMetaType<RemoteWindowServer::Metrics>();
+
+    QObject::connect(encoder_, &RemoteWindowEncoder::frameEncoded, this, &RemoteWindowServer::onEncoderFrameEncoded, Qt::QueuedConnection);
 }
 
 RemoteWindowServer::RemoteWindowServer(QWindow *window, QObject *parent, unsigned short port) :
     RemoteWindowServer(parent, port)
 {
-    window_ = window;
+    attachWindow(window);
 }
 
 RemoteWindowServer::~RemoteWindowServer()
 {
-
+    // Sockets on an I/O thread are deleted by that thread, at the latest when it finishes
+    const QList<RemoteWindowSocket *> sockets = sockets_;
+    for(RemoteWindowSocket *socket : sockets) {
+        if(socket->thread() != thread())
+            releaseSocket(socket);
+    }
+    for(QThread *ioThread : ioThreads_) {
+        ioThread->quit();
+        ioThread->wait();
+    }
 }
 
 bool RemoteWindowServer::start()
@@ -46,7 +98,19 @@ void RemoteWindowServer::stop()
         return;
 
     close();
-    qDeleteAll(sockets_);
+
+    // Deleting a socket of this thread removes it from the list, so iterate a copy
+    const QList<RemoteWindowSocket *> sockets = sockets_;
+    for(RemoteWindowSocket *socket : sockets) {
+        if(socket->thread() == thread())
+            delete socket;
+        else
+            releaseSocket(socket);
+    }
+    if(sockets_.isEmpty()) {
+        stopWindowUpdateTimer();
+        encoder_->reset();
+    }
 }
 
 QWindow *RemoteWindowServer::window() const
@@ -57,7 +121,8 @@ QWindow *RemoteWindowServer::window() const
 void RemoteWindowServer::setWindow(QWindow *value)
 {
     if(window_ != value) {
-        window_ = value;
+        detachWindow();
+        attachWindow(value);
         emit windowChanged();
     }
 }
@@ -85,6 +150,16 @@ void RemoteWindowServer::setScreenShotFunction(ScreenShotFunction value)
     screenShotFunction_ = value;
 }
 
+RemoteWindowServer::ImageCaptureFunction RemoteWindowServer::imageCaptureFunction() const
+{
+    return imageCaptureFunction_;
+}
+
+void RemoteWindowServer::setImageCaptureFunction(ImageCaptureFunction value)
+{
+    imageCaptureFunction_ = value;
+}
+
 int RemoteWindowServer::windowUpdateDelay() const
 {
     return windowUpdateDelay_;
@@ -96,10 +171,32 @@ void RemoteWindowServer::setWindowUpdateDelay(int value)
 
     if(windowUpdateDelay_ != value) {
         windowUpdateDelay_ = value;
+        if(-1 != windowUpdateDelayTimerId_) {
+            stopWindowUpdateTimer();
+            startWindowUpdateTimer();
+        }
+        configureRateControllers();
         emit windowUpdateDelayChanged();
     }
 }
 
+RemoteWindowServer::CaptureMode RemoteWindowServer::captureMode() const
+{
+    return captureMode_;
+}
+
+void RemoteWindowServer::setCaptureMode(CaptureMode value)
+{
+    if(captureMode_ != value) {
+        captureMode_ = value;
+        if(-1 != windowUpdateDelayTimerId_) {
+            stopWindowUpdateTimer();
+            startWindowUpdateTimer();
+        }
+        emit captureModeChanged();
+    }
+}
+
 double RemoteWindowServer::quality() const
 {
     return quality_;
@@ -111,20 +208,265 @@ void RemoteWindowServer::setQuality(double value)
 
     if(quality_ != value) {
         quality_ = value;
+        configureRateControllers();
         emit qualityChanged();
     }
 }
 
+bool RemoteWindowServer::adaptive() const
+{
+    return adaptive_;
+}
+
+void RemoteWindowServer::setAdaptive(bool value)
+{
+    if(adaptive_ != value) {
+        adaptive_ = value;
+        emit adaptiveChanged();
+    }
+}
+
+double RemoteWindowServer::minimumQuality() const
+{
+    return minimumQuality_;
+}
+
+void RemoteWindowServer::setMinimumQuality(double value)
+{
+    value = qBound(0.0, value, 1.0);
+
+    if(minimumQuality_ != value) {
+        minimumQuality_ = value;
+        configureRateControllers();
+        emit minimumQualityChanged();
+    }
+}
+
+int RemoteWindowServer::maximumWindowUpdateDelay() const
+{
+    return maximumWindowUpdateDelay_;
+}
+
+void RemoteWindowServer::setMaximumWindowUpdateDelay(int value)
+{
+    value = qMax(value, WINDOW_UPDATE_DELAY_MIN);
+
+    if(maximumWindowUpdateDelay_ != value) {
+        maximumWindowUpdateDelay_ = value;
+        configureRateControllers();
+        emit maximumWindowUpdateDelayChanged();
+    }
+}
+
+int RemoteWindowServer::targetLatency() const
+{
+    return targetLatency_;
+}
+
+void RemoteWindowServer::setTargetLatency(int value)
+{
+    value = qMax(value, 0);
+
+    if(targetLatency_ != value) {
+        targetLatency_ = value;
+        configureRateControllers();
+        emit targetLatencyChanged();
+    }
+}
+
+int RemoteWindowServer::keepAliveInterval() const
+{
+    return keepAliveInterval_;
+}
+
+void RemoteWindowServer::setKeepAliveInterval(int value)
+{
+    value = qMax(value, WINDOW_UPDATE_DELAY_MIN);
+
+    if(keepAliveInterval_ != value) {
+        keepAliveInterval_ = value;
+        if(CM_DAMAGE == captureMode_ && -1 != windowUpdateDelayTimerId_) {
+            stopWindowUpdateTimer();
+            startWindowUpdateTimer();
+        }
+        emit keepAliveIntervalChanged();
+    }
+}
+
+bool RemoteWindowServer::deltaFrames() const
+{
+    return deltaFrames_;
+}
+
+void RemoteWindowServer::setDeltaFrames(bool value)
+{
+    if(deltaFrames_ != value) {
+        deltaFrames_ = value;
+        emit deltaFramesChanged();
+    }
+}
+
+int RemoteWindowServer::encoderThreadCount() const
+{
+    return encoder_->threadCount();
+}
+
+void RemoteWindowServer::setEncoderThreadCount(int value)
+{
+    // Zero or less picks the number of cores
+    int previous = encoder_->threadCount();
+
+    encoder_->setThreadCount(value);
+    if(encoder_->threadCount() != previous)
+        emit encoderThreadCountChanged();
+}
+
+int RemoteWindowServer::bandHeight() const
+{
+    return bandHeight_;
+}
+
+void RemoteWindowServer::setBandHeight(int value)
+{
+    value = qMax(value, BAND_HEIGHT_MIN);
+
+    if(bandHeight_ != value) {
+        bandHeight_ = value;
+        emit bandHeightChanged();
+    }
+}
+
+qint64 RemoteWindowServer::writeBufferThreshold() const
+{
+    return writeBufferThreshold_;
+}
+
+void RemoteWindowServer::setWriteBufferThreshold(qint64 value)
+{
+    value = qMax(value, Q_INT64_C(0));
+
+    if(writeBufferThreshold_ != value) {
+        writeBufferThreshold_ = value;
+        for(RemoteWindowSocket *socket : sockets_)
+            socket->setWriteBufferThreshold(writeBufferThreshold_);
+        emit writeBufferThresholdChanged();
+    }
+}
+
+int RemoteWindowServer::ioThreadCount() const
+{
+    return ioThreadCount_;
+}
+
+void RemoteWindowServer::setIoThreadCount(int value)
+{
+    // Zero keeps all sockets on this thread, only clients that connect after the change are affected
+    value = qMax(value, 0);
+
+    if(ioThreadCount_ != value) {
+        ioThreadCount_ = value;
+        emit ioThreadCountChanged();
+    }
+}
+
+int RemoteWindowServer::metricsInterval() const
+{
+    return metricsInterval_;
+}
+
+void RemoteWindowServer::setMetricsInterval(int value)
+{
+    // Zero stops the periodic signal, metrics() keeps working but without the rates
+    value = qMax(value, 0);
+
+    if(metricsInterval_ != value) {
+        metricsInterval_ = value;
+        startMetricsTimer();
+        emit metricsIntervalChanged();
+    }
+}
+
 int RemoteWindowServer::clientCount() const
 {
     return sockets_.count();
 }
 
+RemoteWindowServer::Metrics RemoteWindowServer::metrics() const
+{
+    Metrics metrics;
+
+    metrics.captureTime = captureTime_;
+    metrics.encodeTime = encoder_->encodeTime();
+    metrics.compressTime = encoder_->compressTime();
+    metrics.capturedFrames = capturedFrameCount_;
+    metrics.encodedFrames = encoder_->encodedFrameCount();
+    metrics.unchangedFrames = encoder_->unchangedFrameCount();
+    metrics.droppedJobs = encoder_->droppedJobCount();
+    metrics.captureRate = captureRate_;
+    metrics.frameRate = frameRate_;
+    for(RemoteWindowSocket *socket : sockets_)
+        metrics.clients.append(socket->metrics());
+    return metrics;
+}
+
+QJsonObject RemoteWindowServer::metricsToJson(const Metrics &metrics)
+{
+    QJsonObject json;
+    QJsonArray clients;
+
+    for(const RemoteWindowSocket::Metrics &client : metrics.clients) {
+        QJsonObject clientJson;
+
+        clientJson["bytesReceived"] = static_cast<qint64>(client.bytesReceived);
+        clientJson["bytesSent"] = static_cast<qint64>(client.bytesSent);
+        clientJson["messagesReceived"] = static_cast<qint64>(client.messagesReceived);
+        clientJson["messagesSent"] = static_cast<qint64>(client.messagesSent);
+        clientJson["framesReceived"] = static_cast<qint64>(client.framesReceived);
+        clientJson["framesSent"] = static_cast<qint64>(client.framesSent);
+        clientJson["framesSkipped"] = static_cast<qint64>(client.framesSkipped);
+        clientJson["framesDropped"] = static_cast<qint64>(client.framesDropped);
+        clientJson["framesAcknowledged"] = static_cast<qint64>(client.framesAcknowledged);
+        clientJson["decodesSkipped"] = static_cast<qint64>(client.decodesSkipped);
+        clientJson["resyncs"] = static_cast<qint64>(client.resyncs);
+        clientJson["discardedBytes"] = static_cast<qint64>(client.discardedBytes);
+        clientJson["writeBufferHighWater"] = client.writeBufferHighWater;
+        clientJson["roundTripTime"] = client.roundTripTime;
+        clientJson["frameLatency"] = client.frameLatency;
+        clientJson["inputLatency"] = client.inputLatency;
+        clients.append(clientJson);
+    }
+
+    json["captureTime"] = metrics.captureTime.toJson();
+    json["encodeTime"] = metrics.encodeTime.toJson();
+    json["compressTime"] = metrics.compressTime.toJson();
+    json["capturedFrames"] = static_cast<qint64>(metrics.capturedFrames);
+    json["encodedFrames"] = static_cast<qint64>(metrics.encodedFrames);
+    json["unchangedFrames"] = static_cast<qint64>(metrics.unchangedFrames);
+    json["droppedJobs"] = static_cast<qint64>(metrics.droppedJobs);
+    json["captureRate"] = metrics.captureRate;
+    json["frameRate"] = metrics.frameRate;
+    json["clients"] = clients;
+    return json;
+}
+
 void RemoteWindowServer::incomingConnection(qintptr handle)
 {
-    RemoteWindowSocket *socket = new RemoteWindowSocket(handle, this);
+    RemoteWindowSocket *socket;
+
+    if(ioThreadCount_ > 0) {
+        // Reading, parsing and writing happen on the I/O thread. Input comes back through queued
+        // connections, frames go out through the socket's thread safe senders.
+        socket = new RemoteWindowSocket();
+        socket->setWriteBufferThreshold(writeBufferThreshold_);
+        socket->moveToThread(ioThread());
+        QMetaObject::invokeMethod(socket, [socket, handle]() { socket->setSocketDescriptor(handle); }, Qt::QueuedConnection);
+    } else {
+        socket = new RemoteWindowSocket(handle, this);
+        socket->setWriteBufferThreshold(writeBufferThreshold_);
+    }
 
     QObject::connect(socket, &RemoteWindowSocket::disconnected, this, &RemoteWindowServer::onSocketDisconnected);
+    QObject::connect(socket, &RemoteWindowSocket::sessionStateChanged, this, &RemoteWindowServer::onSocketSessionStateChanged);
     QObject::connect(socket, &RemoteWindowSocket::mouseMoveReceived, this, &RemoteWindowServer::onSocketMouseMoveReceived);
     QObject::connect(socket, &RemoteWindowSocket::mousePressReceived, this, &RemoteWindowServer::onSocketMousePressReceived);
     QObject::connect(socket, &RemoteWindowSocket::mouseReleaseReceived, this, &RemoteWindowServer::onSocketMouseReleaseReceived);
@@ -132,20 +474,33 @@ void RemoteWindowServer::incomingConnection(qintptr handle)
     QObject::connect(socket, &RemoteWindowSocket::keyPressReceived, this, &RemoteWindowServer::onSocketKeyPressReceived);
     QObject::connect(socket, &RemoteWindowSocket::keyReleaseReceived, this, &RemoteWindowServer::onSocketKeyReleaseReceived);
     QObject::connect(socket, &RemoteWindowSocket::chatMessageReceived, this, &RemoteWindowServer::onSocketChatMessageReceived);
+    QObject::connect(socket, &RemoteWindowSocket::keyFrameRequestReceived, this, &RemoteWindowServer::onSocketKeyFrameRequestReceived);
+    QObject::connect(socket, &RemoteWindowSocket::keyFrameRequired, this, &RemoteWindowServer::onSocketKeyFrameRequestReceived);
     appendSocket(socket);
 
-    sendChatMessage(QString("%1: joined the chat").arg(socket->peerAddress().toString()));
     if(-1 == windowUpdateDelayTimerId_)
-        windowUpdateDelayTimerId_ = startTimer(windowUpdateDelay_);
+        startWindowUpdateTimer();
 }
 
 void RemoteWindowServer::timerEvent(QTimerEvent *event)
 {
-    if(event->timerId() == windowUpdateDelayTimerId_) {
-        killTimer(windowUpdateDelayTimerId_);
+    // The timer keeps running while a frame is being encoded, so capturing never lags behind real time
+    if(event->timerId() == windowUpdateDelayTimerId_)
         handleWindowUpdate();
-        windowUpdateDelayTimerId_ = startTimer(windowUpdateDelay_);
-    }
+    else if(event->timerId() == damageTimerId_) {
+        killTimer(damageTimerId_);
+        damageTimerId_ = -1;
+        handleWindowUpdate();
+    } else if(event->timerId() == metricsTimerId_)
+        updateMetrics();
+}
+
+bool RemoteWindowServer::eventFilter(QObject *watched, QEvent *event)
+{
+    // Raster windows repaint on an update request, all windows get exposed when (partially) shown again
+    if(watched == window_ && (QEvent::UpdateRequest == event->type() || QEvent::Expose == event->type()))
+        requestWindowUpdate();
+    return QTcpServer::eventFilter(watched, event);
 }
 
 void RemoteWindowServer::appendSocket(RemoteWindowSocket *socket)
@@ -153,22 +508,52 @@ void RemoteWindowServer::appendSocket(RemoteWindowSocket *socket)
     if(nullptr == socket)
         return;
 
+    Client client;
+    client.id = nextClientId_++;
+    client.keyFramePending = true;
+    client.lastFrameTime = -1;
+    client.lastSentTime = -1;
+    client.datagramPacing = -1;
+    configureRateController(client.rateController);
+    client.rateController.reset();
+
     sockets_.append(socket);
+    clients_.insert(socket, client);
     emit clientCountChanged();
 }
 
 void RemoteWindowServer::removeSocket(RemoteWindowSocket *socket)
 {
+    clients_.remove(socket);
     if(sockets_.contains(socket)) {
         sockets_.removeAll(socket);
         emit clientCountChanged();
     }
 }
 
+void RemoteWindowServer::releaseSocket(RemoteWindowSocket *socket)
+{
+    // Signals the socket already queued for us may still arrive, the slots ignore sockets we don't know
+    QObject::disconnect(socket, nullptr, this, nullptr);
+    removeSocket(socket);
+    socket->deleteLater();
+}
+
+QThread *RemoteWindowServer::ioThread()
+{
+    while(ioThreads_.count() < ioThreadCount_) {
+        QThread *ioThread = new QThread(this);
+        ioThread->start();
+        ioThreads_.append(ioThread);
+    }
+
+    nextIoThread_ = (nextIoThread_ + 1) % ioThreadCount_;
+    return ioThreads_.at(nextIoThread_);
+}
+
 void RemoteWindowServer::sendChatMessage(QString msg)
 {
-    for(RemoteWindowSocket *socket : sockets_)
-        socket->sendChatMessage(msg);
+    RemoteWindowSocket::broadcastChatMessage(sockets_, msg);
 }
 
 void RemoteWindowServer::handleWindowUpdate()
@@ -176,14 +561,116 @@ void RemoteWindowServer::handleWindowUpdate()
     if(nullptr == window_)
         return;
 
-    QByteArray data;
-    QBuffer buffer(&data);
+    // Only the grab itself happens on this thread, converting and encoding is up to the encoder
+    RemoteWindowEncoder::Job job;
+    const qint64 now = clock_.elapsed();
+    qint64 nextFrameTime = -1;
+
+    lastCaptureTime_ = now;
+
+    for(RemoteWindowSocket *socket : sockets_) {
+        const RemoteWindowSocket::Status status = socket->status();
+        if(RemoteWindowSocket::SS_JOINED != status.sessionState)
+            continue;
+
+        Client &client = clients_[socket];
+        bool sharedClient = status.features.testFlag(RemoteWindowSocket::SF_SHARED_MEMORY_FRAMES);
+        bool deltaClient = !sharedClient && deltaFrames_ && status.features.testFlag(RemoteWindowSocket::SF_DELTA_FRAMES);
+        bool tiledClient = !sharedClient && status.features.testFlag(RemoteWindowSocket::SF_TILED_FRAMES);
+
+        job.clients.insert(client.id);
+        if(deltaClient)
+            job.deltaClients.insert(client.id);
+
+        // The update timer runs at the fastest allowed rate, every client only gets a frame once its own
+        // interval has passed. Allow half a tick of jitter, otherwise every other tick would be missed.
+        int frameInterval = adaptive_ ? client.rateController.frameInterval() : windowUpdateDelay_;
+        if(client.lastFrameTime >= 0 && now - client.lastFrameTime < frameInterval - windowUpdateDelay_ / 2) {
+            qint64 frameTime = client.lastFrameTime + frameInterval - windowUpdateDelay_ / 2;
+            nextFrameTime = nextFrameTime < 0 ? frameTime : qMin(nextFrameTime, frameTime);
+            continue;
+        }
+
+        // Encoding a delta moves the client's reference on. While its socket still has a backlog the delta
+        // would only queue behind it, so hold off, the next one then covers every change since the last one sent.
+        if(deltaClient && !client.keyFramePending && status.frameBacklog) {
+            qint64 frameTime = now + windowUpdateDelay_;
+            nextFrameTime = nextFrameTime < 0 ? frameTime : qMin(nextFrameTime, frameTime);
+            continue;
+        }
+
+        if(adaptive_) {
+            // Whatever is worst: the socket draining, the backlog still to go, or frames reaching the screen late.
+            // Over datagrams the last one is the only signal there is.
+            qint64 latency = status.drainTime;
+            if(status.throughput > 0)
+                latency = qMax(latency, status.bytesToWrite * 1000 / status.throughput);
+            if(status.frameLatency >= 0)
+                latency = qMax(latency, status.frameLatency / 1000);
+            client.rateController.update(latency);
+        }
+
+        // Datagrams of a frame are spread over half the client's frame interval, as the rate controller lowers
+        // the frame rate the pacing slows down with it. The socket is only told when it changes.
+        if(status.features.testFlag(RemoteWindowSocket::SF_DATAGRAM_FRAMES)) {
+            int pacing = (adaptive_ ? client.rateController.frameInterval() : windowUpdateDelay_) / 2;
+            if(pacing != client.datagramPacing) {
+                client.datagramPacing = pacing;
+                socket->setDatagramPacing(pacing);
+            }
+        }
+
+        RemoteWindowEncoder::Target target;
+        target.client = client.id;
+        target.codec = status.codec;
+        target.quality = adaptive_ ? client.rateController.quality() : quality_;
+        if(status.preferredQuality >= 0.0)
+            target.quality = qMin(target.quality, status.preferredQuality);
+        target.viewportSize = status.viewportSize;
+        target.keepAlive = client.keyFramePending || client.lastSentTime < 0 || now - client.lastSentTime >= keepAliveInterval_;
+        if(sharedClient)
+            target.kind = RemoteWindowEncoder::FK_SHARED_FRAME;
+        else if(!deltaClient)
+            target.kind = tiledClient ? RemoteWindowEncoder::FK_TILED_KEY_FRAME : RemoteWindowEncoder::FK_KEY_FRAME;
+        else if(client.keyFramePending)
+            target.kind = RemoteWindowEncoder::FK_TILED_KEY_FRAME;
+        else
+            target.kind = RemoteWindowEncoder::FK_DELTA_FRAME;
+        job.targets.append(target);
+        client.lastFrameTime = now;
+    }
 
-    if(!buffer.open(QBuffer::WriteOnly))
+    // Without a damage this change would not reach the skipped clients before the fallback timer fires
+    if(CM_DAMAGE == captureMode_ && nextFrameTime >= 0)
+        scheduleWindowUpdate(nextFrameTime - now);
+    if(job.targets.isEmpty())
         return;
 
-    QPixmap pixmap;
+    QElapsedTimer captureTimer;
+
+    captureTimer.start();
+    job.captureTime = RemoteWindowSocket::timestamp();
+    if(!captureWindow(job.image))
+        return;
+
+    job.bandHeight = bandHeight_;
+    captureTime_.add(captureTimer.nsecsElapsed() / 1000);
+    capturedFrameCount_++;
+    encoder_->submit(job);
+}
 
+bool RemoteWindowServer::captureWindow(QImage &image)
+{
+    // The pool only hands out images nobody else references anymore, so a capture can write into one in
+    // place, the encoder gets it in the format it works in and won't have to convert or copy it either.
+    if(nullptr != imageCaptureFunction_) {
+        image = takePooledImage(window_->size() * window_->devicePixelRatio());
+        bool captured = imageCaptureFunction_(window_, image);
+        returnPooledImage(image);
+        return captured && !image.isNull();
+    }
+
+    QPixmap pixmap;
     if(nullptr == screenShotFunction_) {
         QScreen *screen = QGuiApplication::primaryScreen();
 #ifdef Q_OS_WIN
@@ -194,25 +681,188 @@ void RemoteWindowServer::handleWindowUpdate()
     } else
         pixmap = screenShotFunction_(window_);
 
-    if(!pixmap.save(&buffer, "jpeg", quality_ * 100))
+    if(pixmap.isNull())
+        return false;
+
+    // Raster pixmaps hand out their image without a copy. Whatever format it is in, converting it is left
+    // to the encoder thread, the GUI thread only pays for the grab itself.
+    image = pixmap.toImage();
+    return true;
+}
+
+QImage RemoteWindowServer::takePooledImage(const QSize &size)
+{
+    // Free once the only reference left is the pool's own
+    for(int i = 0; i < imagePool_.count(); ++i) {
+        if(imagePool_.at(i).size() == size && imagePool_.at(i).isDetached())
+            return imagePool_.takeAt(i);
+    }
+    return QImage(size, QImage::Format_RGB32);
+}
+
+void RemoteWindowServer::returnPooledImage(const QImage &image)
+{
+    // The oldest go first, so images of a size the window no longer has age out
+    while(imagePool_.count() >= IMAGE_POOL_SIZE)
+        imagePool_.removeFirst();
+    imagePool_.append(image);
+}
+
+void RemoteWindowServer::attachWindow(QWindow *window)
+{
+    window_ = window;
+    if(nullptr == window_)
         return;
 
-    QByteArray compressed = qCompress(data);
-    for(RemoteWindowSocket *socket : sockets_)
-        socket->sendWindowCapture(compressed);
+    window_->installEventFilter(this);
+
+    // OpenGL and Quick windows don't go through update requests for every frame, but tell when one is shown
+    if(-1 != window_->metaObject()->indexOfSignal("frameSwapped()"))
+        QObject::connect(window_, SIGNAL(frameSwapped()), this, SLOT(onWindowFrameSwapped()));
+}
+
+void RemoteWindowServer::detachWindow()
+{
+    if(nullptr == window_)
+        return;
+
+    window_->removeEventFilter(this);
+    QObject::disconnect(window_, nullptr, this, nullptr);
+    window_ = nullptr;
+}
+
+void RemoteWindowServer::requestWindowUpdate()
+{
+    if(CM_DAMAGE == captureMode_)
+        scheduleWindowUpdate(0);
+}
+
+void RemoteWindowServer::scheduleWindowUpdate(qint64 delay)
+{
+    if(sockets_.isEmpty())
+        return;
+
+    // Coalesce bursts of repaints, never capture more often than the window update delay allows
+    const qint64 now = clock_.elapsed();
+    if(lastCaptureTime_ >= 0)
+        delay = qMax(delay, lastCaptureTime_ + windowUpdateDelay_ - now);
+    delay = qMax<qint64>(delay, 0);
+
+    if(-1 != damageTimerId_) {
+        if(damageTime_ <= now + delay)
+            return;
+        killTimer(damageTimerId_);
+    }
+    damageTimerId_ = startTimer(static_cast<int>(delay), Qt::PreciseTimer);
+    damageTime_ = now + delay;
+}
+
+void RemoteWindowServer::startWindowUpdateTimer()
+{
+    // In damage mode the timer only catches repaints we can't see and keeps the keep alive frames going
+    int interval = CM_DAMAGE == captureMode_ ? qMax(windowUpdateDelay_, keepAliveInterval_ / 2) : windowUpdateDelay_;
+
+    windowUpdateDelayTimerId_ = startTimer(interval, Qt::PreciseTimer);
+}
+
+void RemoteWindowServer::stopWindowUpdateTimer()
+{
+    if(-1 != windowUpdateDelayTimerId_)
+        killTimer(windowUpdateDelayTimerId_);
+    if(-1 != damageTimerId_)
+        killTimer(damageTimerId_);
+    windowUpdateDelayTimerId_ = -1;
+    damageTimerId_ = -1;
+}
+
+void RemoteWindowServer::startMetricsTimer()
+{
+    if(-1 != metricsTimerId_)
+        killTimer(metricsTimerId_);
+    metricsTimerId_ = metricsInterval_ > 0 ? startTimer(metricsInterval_) : -1;
+    lastMetricsTime_ = clock_.elapsed();
+    lastCapturedFrameCount_ = capturedFrameCount_;
+    lastEncodedFrameCount_ = encoder_->encodedFrameCount();
+}
+
+void RemoteWindowServer::updateMetrics()
+{
+    const qint64 now = clock_.elapsed();
+    const quint64 encodedFrameCount = encoder_->encodedFrameCount();
+
+    if(now > lastMetricsTime_) {
+        captureRate_ = static_cast<double>(capturedFrameCount_ - lastCapturedFrameCount_) * 1000.0 / (now - lastMetricsTime_);
+        frameRate_ = static_cast<double>(encodedFrameCount - lastEncodedFrameCount_) * 1000.0 / (now - lastMetricsTime_);
+    }
+    lastMetricsTime_ = now;
+    lastCapturedFrameCount_ = capturedFrameCount_;
+    lastEncodedFrameCount_ = encodedFrameCount;
+
+    // Building the snapshot touches every socket, skip it when nobody listens
+    if(isSignalConnected(QMetaMethod::fromSignal(&RemoteWindowServer::metricsUpdated)))
+        emit metricsUpdated(metrics());
+}
+
+QPoint RemoteWindowServer::mapPosition(const QPoint &position) const
+{
+    // Clients with scaled frames point at the image they got, the window expects its own coordinates
+    RemoteWindowSocket *socket = static_cast<RemoteWindowSocket *>(QObject::sender());
+    if(!clients_.contains(socket))
+        return position;
+
+    const Client client = clients_.value(socket);
+    if(client.sentSize.isEmpty() || client.sentSize == client.frameSize)
+        return position;
+    return QPoint(position.x() * client.frameSize.width() / client.sentSize.width(),
+                  position.y() * client.frameSize.height() / client.sentSize.height());
+}
+
+void RemoteWindowServer::configureRateController(RemoteWindowRateController &rateController) const
+{
+    // The static settings bound the controller: quality is the best it may use, the update delay the fastest
+    rateController.setQualityRange(qMin(minimumQuality_, quality_), quality_);
+    rateController.setFrameIntervalRange(windowUpdateDelay_, qMax(windowUpdateDelay_, maximumWindowUpdateDelay_));
+    rateController.setTargetLatency(targetLatency_);
+}
+
+void RemoteWindowServer::configureRateControllers()
+{
+    for(Client &client : clients_)
+        configureRateController(client.rateController);
+}
+
+void RemoteWindowServer::onWindowFrameSwapped()
+{
+    requestWindowUpdate();
 }
 
 void RemoteWindowServer::onSocketDisconnected()
 {
     RemoteWindowSocket *socket = static_cast<RemoteWindowSocket *>(QObject::sender());
+    if(!sockets_.contains(socket))
+        return;
 
     removeSocket(socket);
-    sendChatMessage(QString("%1: left the chat").arg(socket->peerAddress().toString()));
+    sendChatMessage(QString("%1: left the chat").arg(socket->status().peerAddress.toString()));
     socket->deleteLater();
 
     if(sockets_.isEmpty()) {
-        killTimer(windowUpdateDelayTimerId_);
-        windowUpdateDelayTimerId_ = -1;
+        stopWindowUpdateTimer();
+        encoder_->reset();
+    }
+}
+
+void RemoteWindowServer::onSocketSessionStateChanged()
+{
+    RemoteWindowSocket *socket = static_cast<RemoteWindowSocket *>(QObject::sender());
+    if(!sockets_.contains(socket))
+        return;
+
+    // New clients should not have to wait for the next repaint to see the window
+    const RemoteWindowSocket::Status status = socket->status();
+    if(RemoteWindowSocket::SS_JOINED == status.sessionState) {
+        sendChatMessage(QString("%1: joined the chat").arg(status.peerAddress.toString()));
+        requestWindowUpdate();
     }
 }
 
@@ -221,7 +871,7 @@ void RemoteWindowServer::onSocketMouseMoveReceived(const QPoint &position)
     if(nullptr == window_)
         return;
 
-    QTest::mouseMove(window_, position);
+    QTest::mouseMove(window_, mapPosition(position));
 }
 
 void RemoteWindowServer::onSocketMousePressReceived(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
@@ -229,7 +879,7 @@ void RemoteWindowServer::onSocketMousePressReceived(const Qt::MouseButton &butto
     if(nullptr == window_)
         return;
 
-    QTest::mousePress(window_, button, modifiers, position);
+    QTest::mousePress(window_, button, modifiers, mapPosition(position));
 }
 
 void RemoteWindowServer::onSocketMouseReleaseReceived(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
@@ -237,7 +887,7 @@ void RemoteWindowServer::onSocketMouseReleaseReceived(const Qt::MouseButton &but
     if(nullptr == window_)
         return;
 
-    QTest::mouseRelease(window_, button, modifiers, position);
+    QTest::mouseRelease(window_, button, modifiers, mapPosition(position));
 }
 
 void RemoteWindowServer::onSocketMouseClickReceived(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
@@ -245,7 +895,7 @@ void RemoteWindowServer::onSocketMouseClickReceived(const Qt::MouseButton &butto
     if(nullptr == window_)
         return;
 
-    QTest::mouseClick(window_, button, modifiers, position);
+    QTest::mouseClick(window_, button, modifiers, mapPosition(position));
 }
 
 void RemoteWindowServer::onSocketKeyPressReceived(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers)
@@ -265,8 +915,57 @@ void RemoteWindowServer::onSocketKeyReleaseReceived(const Qt::Key &key, const Qt
 }
 
 void RemoteWindowServer::onSocketChatMessageReceived(const QString &msg)
+{
+    RemoteWindowSocket *socket = static_cast<RemoteWindowSocket *>(QObject::sender());
+    if(!sockets_.contains(socket))
+        return;
+
+    sendChatMessage(QString("%1: %2").arg(socket->status().peerAddress.toString()).arg(msg));
+}
+
+void RemoteWindowServer::onSocketKeyFrameRequestReceived()
 {
     RemoteWindowSocket *socket = static_cast<RemoteWindowSocket *>(QObject::sender());
 
-    sendChatMessage(QString("%1: %2").arg(socket->peerAddress().toString()).arg(msg));
+    if(clients_.contains(socket))
+        clients_[socket].keyFramePending = true;
+    requestWindowUpdate();
+}
+
+void RemoteWindowServer::onEncoderFrameEncoded(const RemoteWindowEncoder::Frame &frame)
+{
+    for(RemoteWindowSocket *socket : sockets_) {
+        Client &client = clients_[socket];
+        if(!frame.outputs.contains(client.id))
+            continue;
+
+        const RemoteWindowEncoder::Output output = frame.outputs.value(client.id);
+        client.lastSentTime = clock_.elapsed();
+        client.frameSize = frame.size;
+        client.sentSize = output.size;
+        switch(output.kind) {
+            case RemoteWindowEncoder::FK_KEY_FRAME:
+                socket->sendWindowCapture(output.data, frame.captureTime);
+                client.keyFramePending = false; // Any new frame answers a request after a loss
+                break;
+            case RemoteWindowEncoder::FK_TILED_KEY_FRAME:
+                // Bands are encoded in parallel and the peer composes its image from them, with or without deltas
+                socket->sendWindowTiles(output.data, frame.captureTime);
+                if(!output.data.isEmpty())
+                    client.keyFramePending = false;
+                break;
+            case RemoteWindowEncoder::FK_DELTA_FRAME:
+                // The encoder already moved on with this frame as the reference, if it can't be sent now
+                // the chain is broken and the client has to start over with a key frame.
+                if(client.keyFramePending)
+                    break;
+                socket->sendWindowDelta(output.data, frame.captureTime);
+                break;
+            case RemoteWindowEncoder::FK_SHARED_FRAME:
+                socket->sendWindowShared(output.data, frame.captureTime);
+                if(!output.data.isEmpty())
+                    client.keyFramePending = false; // Otherwise a static window would be copied on every tick
+                break;
+        }
+    }
 }
@@ -1,20 +1,51 @@
 #pragma once
 
+#include "remotewindowencoder.h"
+#include "remotewindowratecontroller.h"
+#include "remotewindowsocket.h"
 #include <QTcpServer>
 #include <QList>
+#include <QHash>
+#include <QElapsedTimer>
 #include <QTimer>
+#include <QJsonObject>
 #include <functional>
 
 class QWindow;
 class QPixmap;
-class RemoteWindowSocket;
+class QThread;
 class RemoteWindowServer : public QTcpServer
 {
     Q_OBJECT
     Q_DISABLE_COPY(RemoteWindowServer)
 
 public:
+    enum CaptureMode
+    {
+        CM_TIMER,   // Capture every window update delay
+        CM_DAMAGE,  // Capture when the window repaints, the timer only runs at the keep alive interval as a fallback
+    };
+
+    struct Metrics
+    {
+        RemoteWindowHistogram captureTime; // In us
+        RemoteWindowHistogram encodeTime; // In us, per frame for all clients together
+        RemoteWindowHistogram compressTime; // In us, per encoded variant
+        quint64 capturedFrames;
+        quint64 encodedFrames;
+        quint64 unchangedFrames;
+        quint64 droppedJobs;
+        double captureRate; // Per second, over the last metrics interval
+        double frameRate; // Encoded frames per second, over the last metrics interval
+        QList<RemoteWindowSocket::Metrics> clients;
+    };
+
     using ScreenShotFunction = std::function<QPixmap(QWindow *)>;
+
+    // Fills the given image with the window's pixels and returns whether it did. The image comes from a pool,
+    // is sized to the window in device pixels and is RGB32, writing into it as is costs no allocation at all.
+    // Takes precedence over the screen shot function.
+    using ImageCaptureFunction = std::function<bool(QWindow *, QImage &)>;
     RemoteWindowServer(QObject *parent = nullptr, unsigned short port = 55555);
     RemoteWindowServer(QWindow *window, QObject *parent = nullptr, unsigned short port = 55555);
     virtual ~RemoteWindowServer() override;
@@ -31,44 +62,170 @@ public:
     ScreenShotFunction screenShotFunction() const;
     void setScreenShotFunction(ScreenShotFunction value);
 
+    ImageCaptureFunction imageCaptureFunction() const;
+    void setImageCaptureFunction(ImageCaptureFunction value);
+
     int windowUpdateDelay() const;
     void setWindowUpdateDelay(int value);
 
+    CaptureMode captureMode() const;
+    void setCaptureMode(CaptureMode value);
+
     double quality() const;
     void setQuality(double value);
 
+    bool adaptive() const;
+    void setAdaptive(bool value);
+
+    double minimumQuality() const;
+    void setMinimumQuality(double value);
+
+    int maximumWindowUpdateDelay() const;
+    void setMaximumWindowUpdateDelay(int value);
+
+    int targetLatency() const;
+    void setTargetLatency(int value);
+
+    int keepAliveInterval() const;
+    void setKeepAliveInterval(int value);
+
+    bool deltaFrames() const;
+    void setDeltaFrames(bool value);
+
+    int encoderThreadCount() const;
+    void setEncoderThreadCount(int value);
+
+    int bandHeight() const;
+    void setBandHeight(int value);
+
+    qint64 writeBufferThreshold() const;
+    void setWriteBufferThreshold(qint64 value);
+
+    int ioThreadCount() const;
+    void setIoThreadCount(int value);
+
+    int metricsInterval() const;
+    void setMetricsInterval(int value);
+
     int clientCount() const;
+    Metrics metrics() const;
+
+    // Machine readable, for logging and for comparing runs
+    static QJsonObject metricsToJson(const Metrics &metrics);
 
 private:
+    struct Client
+    {
+        quint32 id;
+        bool keyFramePending;
+        qint64 lastFrameTime;
+        qint64 lastSentTime;
+        int datagramPacing;
+        QSize frameSize; // Of the last frame sent and of the image the client got of it, which differ when scaled
+        QSize sentSize;
+        RemoteWindowRateController rateController;
+    };
+
     static const double QUALITY_DEFAULT;
+    static const double MINIMUM_QUALITY_DEFAULT;
+    static const int MAXIMUM_WINDOW_UPDATE_DELAY_DEFAULT;
+    static const int TARGET_LATENCY_DEFAULT;
+    static const int KEEP_ALIVE_INTERVAL_DEFAULT;
     static const int WINDOW_UPDATE_DELAY_MIN;
     static const int WINDOW_UPDATE_DELAY_DEFAULT;
+    static const int BAND_HEIGHT_MIN;
+    static const int BAND_HEIGHT_DEFAULT;
+    static const qint64 WRITE_BUFFER_THRESHOLD_DEFAULT;
+    static const int METRICS_INTERVAL_DEFAULT;
+    static const int IMAGE_POOL_SIZE;
 
     virtual void incomingConnection(qintptr handle) override;
     virtual void timerEvent(QTimerEvent *event) override;
+    virtual bool eventFilter(QObject *watched, QEvent *event) override;
 
     void appendSocket(RemoteWindowSocket *socket);
     void removeSocket(RemoteWindowSocket *socket);
+    void releaseSocket(RemoteWindowSocket *socket);
+    QThread *ioThread();
     void sendChatMessage(QString msg);
+    QPoint mapPosition(const QPoint &position) const;
     void handleWindowUpdate();
+    bool captureWindow(QImage &image);
+    QImage takePooledImage(const QSize &size);
+    void returnPooledImage(const QImage &image);
+    void attachWindow(QWindow *window);
+    void detachWindow();
+    void requestWindowUpdate();
+    void scheduleWindowUpdate(qint64 delay);
+    void startWindowUpdateTimer();
+    void stopWindowUpdateTimer();
+    void configureRateController(RemoteWindowRateController &rateController) const;
+    void configureRateControllers();
+    void startMetricsTimer();
+    void updateMetrics();
 
     QWindow *window_;
     QList<RemoteWindowSocket *> sockets_;
+    QHash<RemoteWindowSocket *, Client> clients_;
+    quint32 nextClientId_;
+    QElapsedTimer clock_;
+    RemoteWindowEncoder *encoder_;
     ScreenShotFunction screenShotFunction_;
+    ImageCaptureFunction imageCaptureFunction_;
+    QList<QImage> imagePool_;
     double quality_;
+    bool adaptive_;
+    double minimumQuality_;
+    int maximumWindowUpdateDelay_;
+    int targetLatency_;
+    int keepAliveInterval_;
+    bool deltaFrames_;
+    int bandHeight_;
+    qint64 writeBufferThreshold_;
+    QList<QThread *> ioThreads_;
+    int ioThreadCount_;
+    int nextIoThread_;
     int windowUpdateDelayTimerId_;
     int windowUpdateDelay_;
+    CaptureMode captureMode_;
+    int damageTimerId_;
+    qint64 damageTime_;
+    qint64 lastCaptureTime_;
+    RemoteWindowHistogram captureTime_;
+    quint64 capturedFrameCount_;
+    int metricsInterval_;
+    int metricsTimerId_;
+    qint64 lastMetricsTime_;
+    quint64 lastCapturedFrameCount_;
+    quint64 lastEncodedFrameCount_;
+    double captureRate_;
+    double frameRate_;
     unsigned short port_;
 
 signals:
     void windowChanged();
     void portChanged();
     void windowUpdateDelayChanged();
+    void captureModeChanged();
     void qualityChanged();
+    void adaptiveChanged();
+    void minimumQualityChanged();
+    void maximumWindowUpdateDelayChanged();
+    void targetLatencyChanged();
+    void keepAliveIntervalChanged();
+    void deltaFramesChanged();
+    void encoderThreadCountChanged();
+    void bandHeightChanged();
+    void writeBufferThresholdChanged();
+    void ioThreadCountChanged();
+    void metricsIntervalChanged();
+    void metricsUpdated(const RemoteWindowServer::Metrics &metrics);
     void clientCountChanged();
 
 private slots:
+    void onWindowFrameSwapped();
     void onSocketDisconnected();
+    void onSocketSessionStateChanged();
     void onSocketMouseMoveReceived(const QPoint &position);
     void onSocketMousePressReceived(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers);
     void onSocketMouseReleaseReceived(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers);
@@ -76,4 +233,8 @@ private slots:
     void onSocketKeyPressReceived(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers);
     void onSocketKeyReleaseReceived(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers);
     void onSocketChatMessageReceived(const QString &msg);
+    void onSocketKeyFrameRequestReceived();
+    void onEncoderFrameEncoded(const RemoteWindowEncoder::Frame &frame);
 };
+
+Q_DECLARE_METATYPE(RemoteWindowServer::Metrics)
@@ -0,0 +1,179 @@
+#include "remotewindowsharedmemory.h"
+#include <QCoreApplication>
+#include <QDataStream>
+#include <cstring>
+#include <limits>
+
+const quint32 RemoteWindowSharedMemory::SEGMENT_MAGIC = 0x52575348; // "RWSH"
+const int RemoteWindowSharedMemory::SLOT_COUNT = 4; // One being written, the newest, and one held per reader to spare
+const int RemoteWindowSharedMemory::SEGMENT_HEADER_SIZE = 64; // In bytes, keeps the slots cache line aligned
+const int RemoteWindowSharedMemory::SLOT_HEADER_SIZE = 64; // In bytes
+
+RemoteWindowSharedMemory::RemoteWindowSharedMemory()
+{
+    slotSize_ = 0;
+    sequence_ = 0;
+    generation_ = 0;
+    lastSlot_ = -1;
+    heldSlot_ = -1;
+}
+
+RemoteWindowSharedMemory::~RemoteWindowSharedMemory()
+{
+    release();
+}
+
+QByteArray RemoteWindowSharedMemory::write(const QImage &image)
+{
+    const int frameSize = image.bytesPerLine() * image.height();
+
+    if(image.isNull())
+        return QByteArray();
+
+    // A segment can't grow, a frame that doesn't fit gets a new segment under a new key. The reader
+    // moves over on the next notification and the old segment goes away once it has detached.
+    if(!memory_.isAttached() || frameSize > slotSize_) {
+        SegmentHeader header;
+
+        memory_.detach();
+        memory_.setKey(QString("qt-remote-window-%1-%2").arg(QCoreApplication::applicationPid()).arg(generation_++));
+        if(!memory_.create(SEGMENT_HEADER_SIZE + SLOT_COUNT * (SLOT_HEADER_SIZE + frameSize))) {
+            slotSize_ = 0;
+            return QByteArray();
+        }
+
+        slotSize_ = frameSize;
+        lastSlot_ = -1;
+        header.magic = SEGMENT_MAGIC;
+        header.slotCount = static_cast<quint32>(SLOT_COUNT);
+        header.slotSize = static_cast<quint32>(slotSize_);
+        memcpy(memory_.data(), &header, sizeof(header));
+        for(int i = 0; i < SLOT_COUNT; ++i)
+            memset(slot(i), 0, SLOT_HEADER_SIZE);
+    }
+
+    // Take a slot no reader holds. Its sequence is cleared while the pixels go in, so no reader can take
+    // it before the header is complete. Both sides run on the same host, everything stays in native byte order.
+    if(!memory_.lock())
+        return QByteArray();
+
+    int index = -1;
+    for(int i = 1; i <= SLOT_COUNT && index < 0; ++i) {
+        const int candidate = (lastSlot_ + i) % SLOT_COUNT;
+        if(candidate != lastSlot_ && 0 == slotHeader(candidate)->readers)
+            index = candidate;
+    }
+    if(index >= 0)
+        slotHeader(index)->sequence = 0;
+    memory_.unlock();
+    if(index < 0)
+        return QByteArray(); // Every reader is still busy with an older frame
+
+    const quint32 sequence = ++sequence_;
+    memcpy(slot(index) + SLOT_HEADER_SIZE, image.constBits(), static_cast<size_t>(frameSize));
+
+    if(!memory_.lock())
+        return QByteArray();
+
+    SlotHeader *header = slotHeader(index);
+    header->sequence = sequence;
+    header->width = static_cast<quint32>(image.width());
+    header->height = static_cast<quint32>(image.height());
+    header->bytesPerLine = static_cast<quint32>(image.bytesPerLine());
+    header->format = static_cast<quint32>(image.format());
+    memory_.unlock();
+    lastSlot_ = index;
+
+    QByteArray notification;
+    QDataStream stream(&notification, QIODevice::WriteOnly);
+
+    stream << memory_.key() << static_cast<quint32>(index) << sequence;
+    return notification;
+}
+
+QImage RemoteWindowSharedMemory::read(const QByteArray &notification)
+{
+    QString key;
+    quint32 index = 0;
+    quint32 sequence = 0;
+    QDataStream stream(notification);
+
+    stream >> key >> index >> sequence;
+    if(QDataStream::Ok != stream.status() || key.isEmpty())
+        return QImage();
+
+    if(!memory_.isAttached() || memory_.key() != key) {
+        SegmentHeader header;
+
+        release();
+        memory_.setKey(key);
+        if(!memory_.attach(QSharedMemory::ReadWrite)) // To hold slots
+            return QImage();
+
+        // The header comes from another process, the slots it describes have to lie within the mapping
+        memcpy(&header, memory_.constData(), sizeof(header));
+        const qint64 segmentSize = SEGMENT_HEADER_SIZE + static_cast<qint64>(SLOT_COUNT) * (SLOT_HEADER_SIZE + static_cast<qint64>(header.slotSize));
+        if(SEGMENT_MAGIC != header.magic || static_cast<quint32>(SLOT_COUNT) != header.slotCount
+            || header.slotSize > static_cast<quint32>(std::numeric_limits<int>::max()) || memory_.size() < segmentSize) {
+            memory_.detach();
+            return QImage();
+        }
+        slotSize_ = static_cast<int>(header.slotSize);
+    }
+
+    if(index >= static_cast<quint32>(SLOT_COUNT))
+        return QImage();
+
+    if(!memory_.lock())
+        return QImage();
+
+    // A different sequence means the writer already reused the slot, a newer notification is on its way.
+    // Otherwise the slot is held from here on and the previous one is given back.
+    SlotHeader header = *slotHeader(static_cast<int>(index));
+    bool valid = sequence == header.sequence && header.width > 0 && header.height > 0
+              && header.format > static_cast<quint32>(QImage::Format_Invalid) && header.format < static_cast<quint32>(QImage::NImageFormats)
+              && static_cast<quint64>(header.bytesPerLine) * header.height <= static_cast<quint64>(slotSize_);
+    if(valid) {
+        slotHeader(static_cast<int>(index))->readers++;
+        if(heldSlot_ >= 0 && slotHeader(heldSlot_)->readers > 0)
+            slotHeader(heldSlot_)->readers--;
+        heldSlot_ = static_cast<int>(index);
+    }
+    memory_.unlock();
+    if(!valid)
+        return QImage();
+
+    return QImage(slot(static_cast<int>(index)) + SLOT_HEADER_SIZE, static_cast<int>(header.width), static_cast<int>(header.height),
+                  static_cast<int>(header.bytesPerLine), static_cast<QImage::Format>(header.format));
+}
+
+void RemoteWindowSharedMemory::release()
+{
+    releaseSlot();
+    memory_.detach();
+    slotSize_ = 0;
+    lastSlot_ = -1;
+}
+
+uchar *RemoteWindowSharedMemory::slot(int index) const
+{
+    return static_cast<uchar *>(const_cast<void *>(memory_.constData())) + SEGMENT_HEADER_SIZE + index * (SLOT_HEADER_SIZE + slotSize_);
+}
+
+RemoteWindowSharedMemory::SlotHeader *RemoteWindowSharedMemory::slotHeader(int index) const
+{
+    return reinterpret_cast<SlotHeader *>(slot(index));
+}
+
+void RemoteWindowSharedMemory::releaseSlot()
+{
+    if(heldSlot_ < 0)
+        return;
+
+    if(memory_.isAttached() && memory_.lock()) {
+        if(slotHeader(heldSlot_)->readers > 0)
+            slotHeader(heldSlot_)->readers--;
+        memory_.unlock();
+    }
+    heldSlot_ = -1;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QSharedMemory>
+#include <QByteArray>
+#include <QImage>
+
+// A ring of raw frame buffers in shared memory, for viewers on the same host. The writer copies each
+// frame into a free slot and hands out a small notification, the reader maps that slot straight
+// into a QImage and holds it, the writer skips held slots. The session itself (control, input,
+// notifications) still runs over the socket.
+class RemoteWindowSharedMemory
+{
+    Q_DISABLE_COPY(RemoteWindowSharedMemory)
+
+public:
+    RemoteWindowSharedMemory();
+    ~RemoteWindowSharedMemory();
+
+    // Writer side, returns the notification for the peer or an empty array if the segment could not be
+    // created or the readers hold every slot it could use
+    QByteArray write(const QImage &image);
+
+    // Reader side. The image does not own its pixels, the slot is held until the next successful read()
+    // or release(), the writer never touches it before that. Copy the image if it has to live longer.
+    QImage read(const QByteArray &notification);
+
+    void release();
+
+private:
+    static const quint32 SEGMENT_MAGIC;
+    static const int SLOT_COUNT;
+    static const int SEGMENT_HEADER_SIZE;
+    static const int SLOT_HEADER_SIZE;
+
+    struct SegmentHeader
+    {
+        quint32 magic;
+        quint32 slotCount;
+        quint32 slotSize;
+    };
+
+    struct SlotHeader
+    {
+        quint32 sequence;
+        quint32 width;
+        quint32 height;
+        quint32 bytesPerLine;
+        quint32 format;
+        quint32 readers; // Only touched with the segment locked
+    };
+
+    uchar *slot(int index) const;
+    SlotHeader *slotHeader(int index) const;
+    void releaseSlot();
+
+    QSharedMemory memory_;
+    int slotSize_;
+    quint32 sequence_;
+    quint32 generation_;
+    int lastSlot_; // Writer side, its notification may still be on its way so it is never reused right away
+    int heldSlot_; // Reader side
+};
@@ -2,6 +2,15 @@
 #include <QByteArray>
 #include <QDataStream>
 #include <QPoint>
+#include <QtEndian>
+#include <QMetaMethod>
+#include <QTimerEvent>
+#include <QThread>
+#include <QMutexLocker>
+#include <QUdpSocket>
+#include <QRandomGenerator>
+#include <QDeadlineTimer>
+#include <cstring>
 
 const QMap<RemoteWindowSocket::SocketCommand, RemoteWindowSocket::SocketState> RemoteWindowSocket::SOCKET_STATE_MAPPING =
 {
@@ -16,24 +25,107 @@ const QMap<RemoteWindowSocket::SocketCommand, RemoteWindowSocket::SocketState> R
     { RemoteWindowSocket::SC_KEY_PRESS,         RemoteWindowSocket::SS_PROCESS_KEY_PRESS        },
     { RemoteWindowSocket::SC_KEY_RELEASE,       RemoteWindowSocket::SS_PROCESS_KEY_RELEASE      },
     { RemoteWindowSocket::SC_CHAT_MESSAGE,      RemoteWindowSocket::SS_PROCESS_CHAT_MESSAGE     },
+    { RemoteWindowSocket::SC_WINDOW_DELTA,      RemoteWindowSocket::SS_PROCESS_WINDOW_DELTA     },
+    { RemoteWindowSocket::SC_KEY_FRAME_REQUEST, RemoteWindowSocket::SS_PROCESS_KEY_FRAME_REQUEST },
+    { RemoteWindowSocket::SC_WINDOW_TILES,      RemoteWindowSocket::SS_PROCESS_WINDOW_TILES     },
+    { RemoteWindowSocket::SC_INPUT_BATCH,       RemoteWindowSocket::SS_PROCESS_INPUT_BATCH      },
+    { RemoteWindowSocket::SC_WINDOW_SHARED,     RemoteWindowSocket::SS_PROCESS_WINDOW_SHARED    },
+    { RemoteWindowSocket::SC_PING,              RemoteWindowSocket::SS_PROCESS_PING             },
+    { RemoteWindowSocket::SC_PONG,              RemoteWindowSocket::SS_PROCESS_PONG             },
+    { RemoteWindowSocket::SC_FRAME_ACK,         RemoteWindowSocket::SS_PROCESS_FRAME_ACK        },
 };
 
-const int RemoteWindowSocket::BUFFER_MAX_SIZE = 1024 * 1024 * 20;
-const int RemoteWindowSocket::QUEUE_MAX_SIZE = 25;
+const int RemoteWindowSocket::PAYLOAD_MAX_SIZE = 1024 * 1024 * 20;
+const int RemoteWindowSocket::LEGACY_HEADER_MAX_SIZE = 64;
+const qint64 RemoteWindowSocket::WRITE_BUFFER_THRESHOLD_DEFAULT = 1024 * 64;
+const int RemoteWindowSocket::QUEUE_MAX_SIZE = 25; // Frames only, anything else is never dropped
+const int RemoteWindowSocket::PENDING_DELTAS_MAX_SIZE = 8; // The sender holds back deltas on a backlog, more only pile up on a dead link
 const int RemoteWindowSocket::CHAT_MSG_MAX_SIZE = 1024;
+const int RemoteWindowSocket::INPUT_BATCH_MAX_SIZE = 64;
+const int RemoteWindowSocket::FRAGMENT_SIZE = 1024 * 16; // In bytes
+const int RemoteWindowSocket::DATAGRAM_HEADER_SIZE = 16; // magic(2) command(1) codec(1) sequence(4) frame(4) index(2) count(2)
+const int RemoteWindowSocket::DATAGRAM_PAYLOAD_SIZE = 1200; // In bytes, fits the path MTU of about any link without IP fragmentation
+const int RemoteWindowSocket::DATAGRAM_BUFFER_SIZE = 1024 * 1024; // In bytes, also the most that is queued for pacing
+const int RemoteWindowSocket::DATAGRAM_PACING_INTERVAL = 2; // In ms
+const int RemoteWindowSocket::DATAGRAM_BURST_SIZE = 1024 * 16; // In bytes, sent at once after a pause
+const qint64 RemoteWindowSocket::DATAGRAM_RATE_MIN = 1024 * 64; // In bytes per second
+const int RemoteWindowSocket::DATAGRAM_REASSEMBLY_TIMEOUT = 200; // In ms, since the first datagram of a frame
+const int RemoteWindowSocket::FRAME_TIMING_SIZE = 12; // sequence(4) capture time(8), written in front of the payload
+const int RemoteWindowSocket::PING_INTERVAL = 1000; // In ms
+const int RemoteWindowSocket::READ_INTERVAL = 50; // In ms, only used with a read rate
 const char RemoteWindowSocket::MESSAGE_START_MARKER = 0x01; // Start of heading
 const char RemoteWindowSocket::MESSAGE_END_MARKER = 0x04; // End of transmission
 const char RemoteWindowSocket::MESSAGE_PAYLOAD_SIZE_MARKER = 0x11; // Horizontal tab
 const char RemoteWindowSocket::MESSAGE_PAYLOAD_MARKER = 0x09; // Vertical tab
+const quint16 RemoteWindowSocket::FRAME_MAGIC = 0x5257; // "RW", first byte must never equal MESSAGE_START_MARKER
+const quint8 RemoteWindowSocket::FRAME_VERSION = 1;
+const int RemoteWindowSocket::FRAME_HEADER_SIZE = 12; // magic(2) version(1) command(1) flags(1) codec(1) stream(2) payload size(4)
+const RemoteWindowSocket::SessionFeatures RemoteWindowSocket::SUPPORTED_FEATURES = RemoteWindowSocket::SF_DELTA_FRAMES | RemoteWindowSocket::SF_INPUT_BATCHES | RemoteWindowSocket::SF_CHUNKED_FRAMES
+                                                                    | RemoteWindowSocket::SF_SHARED_MEMORY_FRAMES | RemoteWindowSocket::SF_DATAGRAM_FRAMES
+                                                                    | RemoteWindowSocket::SF_FRAME_TIMING | RemoteWindowSocket::SF_SCALED_FRAMES | RemoteWindowSocket::SF_TILED_FRAMES;
 
 RemoteWindowSocket::RemoteWindowSocket(QObject *parent) :
     QTcpSocket(parent)
 {
     socketState_ = SS_READ_MESSAGE;
     sessionState_ = SS_NO_SESSION;
+    wireFormat_ = WF_LEGACY;
+    requestedFeatures_ = SF_INPUT_BATCHES | SF_CHUNKED_FRAMES | SF_FRAME_TIMING | SF_SCALED_FRAMES | SF_TILED_FRAMES; // Transparent to the user, so on unless the peer doesn't know them
+    features_ = SF_NONE;
+    preferredCodecs_ << RemoteWindowCodec::CI_JPEG << RemoteWindowCodec::CI_JPEG_ZLIB;
+    codec_ = RemoteWindowCodec::CI_JPEG_ZLIB;
+    preferredQuality_ = -1.0;
+    resyncCount_ = 0;
+    discardedByteCount_ = 0;
+    writeBufferThreshold_ = WRITE_BUFFER_THRESHOLD_DEFAULT;
+    awaitingKeyFrame_ = false;
+    hasOutgoing_ = false;
+    outgoingOffset_ = 0;
+    outgoingStream_ = 0;
+    nextStream_ = 0;
+    outgoingProtected_ = false;
+    memset(receiveCounters_, 0, sizeof(receiveCounters_));
+    memset(sendCounters_, 0, sizeof(sendCounters_));
+    drainStart_ = -1;
+    lastFrameTime_ = -1;
+    inputBatchDelay_ = 0;
+    inputBatchTimerId_ = -1;
+    inputBatchTimerDelay_ = 0;
+    coalescedMoveCount_ = 0;
+    statusDrainStart_ = -1;
+    drainBytes_ = 0;
+    drainTime_ = 0;
+    throughput_ = 0;
+    udpSocket_ = new QUdpSocket(this);
+    decoder_ = new RemoteWindowDecoder(this);
+    datagramPort_ = 0;
+    nextDatagramFrame_ = 0;
+    nextDatagramSequence_ = 0;
+    datagramLossRate_ = 0.0;
+    lostDatagramCount_ = 0;
+    bytesReceived_ = 0;
+    bytesSent_ = 0;
+    writeBufferHighWater_ = 0;
+    pingTimerId_ = -1;
+    datagramTimerId_ = -1;
+    datagramPacingTimerId_ = -1;
+    datagramPacing_ = 0;
+    framesAcknowledged_ = 0;
+    readRate_ = 0;
+    readTimerId_ = -1;
+    clock_.start();
+    resetParser();
+    resetPendingFrame();
+    resetDatagrams();
+    resetTiming();
+    updateStatus();
 
     QObject::connect(this, &QTcpSocket::stateChanged, this, &RemoteWindowSocket::onStateChanged);
-    QObject::connect(this, &QTcpSocket::readyRead, this, &RemoteWindowSocket::process);
+    QObject::connect(this, &QTcpSocket::readyRead, this, &RemoteWindowSocket::onReadyRead);
+    QObject::connect(this, &QTcpSocket::bytesWritten, this, &RemoteWindowSocket::onBytesWritten);
+    QObject::connect(udpSocket_, &QUdpSocket::readyRead, this, &RemoteWindowSocket::onDatagramsReady);
+    QObject::connect(decoder_, &RemoteWindowDecoder::frameDecoded, this, &RemoteWindowSocket::onDecoderFrameDecoded);
+    QObject::connect(decoder_, &RemoteWindowDecoder::keyFrameRequired, this, &RemoteWindowSocket::sendKeyFrameRequest);
     QObject::connect(this, &QTcpSocket::connected, [&]() {
         if(SS_NO_SESSION == sessionState_) {
             setSessionState(SS_JOINING);
@@ -51,6 +143,7 @@ RemoteWindowSocket::RemoteWindowSocket(qintptr handle, QObject *parent) :
 RemoteWindowSocket::~RemoteWindowSocket()
 {
     if(SS_JOINED == sessionState_) {
+        flushInputBatch();
         sendLeaveSession();
         waitForBytesWritten();
     }
@@ -61,193 +154,1682 @@ RemoteWindowSocket::SessionState RemoteWindowSocket::sessionState() const
     return sessionState_;
 }
 
-void RemoteWindowSocket::sendWindowCapture(const QByteArray &compressed)
+RemoteWindowSocket::Status RemoteWindowSocket::status() const
+{
+    QMutexLocker locker(&statusMutex_);
+    Status status = status_;
+
+    if(statusDrainStart_ >= 0)
+        status.drainTime = qMax(status.drainTime, clock_.elapsed() - statusDrainStart_);
+    return status;
+}
+
+RemoteWindowSocket::Metrics RemoteWindowSocket::metrics() const
+{
+    QMutexLocker locker(&statusMutex_);
+
+    return metrics_;
+}
+
+quint64 RemoteWindowSocket::resyncCount() const
+{
+    return resyncCount_;
+}
+
+quint64 RemoteWindowSocket::discardedByteCount() const
+{
+    return discardedByteCount_;
+}
+
+quint64 RemoteWindowSocket::skippedFrameCount() const
+{
+    return sendCounters_[MC_FRAME].dropped;
+}
+
+RemoteWindowSocket::QueueCounters RemoteWindowSocket::receiveCounters(MessageClass messageClass) const
+{
+    return receiveCounters_[messageClass];
+}
+
+RemoteWindowSocket::QueueCounters RemoteWindowSocket::sendCounters(MessageClass messageClass) const
+{
+    return sendCounters_[messageClass];
+}
+
+qint64 RemoteWindowSocket::drainTime() const
+{
+    // How long it took to get the last frames out, or how long the current ones are taking already
+    if(drainStart_ >= 0)
+        return qMax(drainTime_, clock_.elapsed() - drainStart_);
+    return drainTime_;
+}
+
+qint64 RemoteWindowSocket::throughput() const
+{
+    return throughput_;
+}
+
+qint64 RemoteWindowSocket::frameAge() const
+{
+    // The server keeps sending frames at a low rate on a static window, an old frame means a dead link
+    if(lastFrameTime_ < 0)
+        return -1;
+    return clock_.elapsed() - lastFrameTime_;
+}
+
+qint64 RemoteWindowSocket::writeBufferThreshold() const
+{
+    return writeBufferThreshold_;
+}
+
+void RemoteWindowSocket::setWriteBufferThreshold(qint64 value)
+{
+    if(QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [this, value]() { setWriteBufferThreshold(value); }, Qt::QueuedConnection);
+        return;
+    }
+
+    writeBufferThreshold_ = qMax(value, Q_INT64_C(0));
+}
+
+int RemoteWindowSocket::inputBatchDelay() const
+{
+    return inputBatchDelay_;
+}
+
+void RemoteWindowSocket::setInputBatchDelay(int value)
+{
+    inputBatchDelay_ = qMax(value, 0);
+}
+
+quint64 RemoteWindowSocket::coalescedMoveCount() const
+{
+    return coalescedMoveCount_;
+}
+
+quint64 RemoteWindowSocket::skippedDecodeCount() const
+{
+    return decoder_->droppedJobCount();
+}
+
+qint64 RemoteWindowSocket::readRate() const
+{
+    return readRate_;
+}
+
+void RemoteWindowSocket::setReadRate(qint64 value)
+{
+    readRate_ = qMax<qint64>(value, 0);
+    if(-1 != readTimerId_)
+        killTimer(readTimerId_);
+    readTimerId_ = -1;
+
+    if(readRate_ > 0) {
+        // Once its buffer is full the socket stops pulling from the kernel, so the peer really sees a slow link
+        setReadBufferSize(qMax<qint64>(readRate_ * READ_INTERVAL / 1000, FRAME_HEADER_SIZE + LEGACY_HEADER_MAX_SIZE));
+        readTimerId_ = startTimer(READ_INTERVAL, Qt::PreciseTimer);
+    } else {
+        setReadBufferSize(0);
+        QMetaObject::invokeMethod(this, [this]() { process(); }, Qt::QueuedConnection);
+    }
+}
+
+double RemoteWindowSocket::datagramLossRate() const
+{
+    return datagramLossRate_;
+}
+
+void RemoteWindowSocket::setDatagramLossRate(double value)
+{
+    datagramLossRate_ = qBound(0.0, value, 1.0);
+}
+
+quint64 RemoteWindowSocket::lostDatagramCount() const
+{
+    return lostDatagramCount_;
+}
+
+int RemoteWindowSocket::datagramPacing() const
+{
+    return datagramPacing_;
+}
+
+void RemoteWindowSocket::setDatagramPacing(int value)
+{
+    if(QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [this, value]() { setDatagramPacing(value); }, Qt::QueuedConnection);
+        return;
+    }
+
+    datagramPacing_ = qMax(value, 0);
+}
+
+RemoteWindowSocket::SessionFeatures RemoteWindowSocket::requestedFeatures() const
+{
+    return requestedFeatures_;
+}
+
+void RemoteWindowSocket::setRequestedFeatures(SessionFeatures value)
+{
+    requestedFeatures_ = value;
+}
+
+RemoteWindowSocket::SessionFeatures RemoteWindowSocket::features() const
+{
+    return features_;
+}
+
+QList<quint8> RemoteWindowSocket::preferredCodecs() const
+{
+    return preferredCodecs_;
+}
+
+void RemoteWindowSocket::setPreferredCodecs(const QList<quint8> &value)
+{
+    preferredCodecs_ = value;
+}
+
+quint8 RemoteWindowSocket::codec() const
+{
+    return codec_;
+}
+
+QSize RemoteWindowSocket::viewportSize() const
+{
+    return viewportSize_;
+}
+
+void RemoteWindowSocket::setViewportSize(const QSize &value)
+{
+    viewportSize_ = value;
+}
+
+double RemoteWindowSocket::preferredQuality() const
+{
+    return preferredQuality_;
+}
+
+void RemoteWindowSocket::setPreferredQuality(double value)
+{
+    preferredQuality_ = value < 0.0 ? -1.0 : qMin(value, 1.0);
+}
+
+QImage RemoteWindowSocket::windowImage() const
+{
+    return windowImage_;
+}
+
+void RemoteWindowSocket::sendWindowCapture(const QByteArray &encoded, qint64 captureTime)
+{
+    if(QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [this, encoded, captureTime]() { sendWindowCapture(encoded, captureTime); }, Qt::QueuedConnection);
+        return;
+    }
+    if(SS_JOINED != sessionState_)
+        return;
+    if(encoded.isEmpty())
+        return;
+
+    sendWindowFrame(SC_WINDOW_CAPTURE, encoded, captureTime);
+}
+
+void RemoteWindowSocket::sendWindowDelta(const QByteArray &delta, qint64 captureTime)
+{
+    if(QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [this, delta, captureTime]() { sendWindowDelta(delta, captureTime); }, Qt::QueuedConnection);
+        return;
+    }
+    if(SS_JOINED != sessionState_)
+        return;
+    if(delta.isEmpty() || !features_.testFlag(SF_DELTA_FRAMES))
+        return;
+
+    sendWindowFrame(SC_WINDOW_DELTA, delta, captureTime);
+}
+
+void RemoteWindowSocket::sendWindowTiles(const QByteArray &tiles, qint64 captureTime)
+{
+    if(QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [this, tiles, captureTime]() { sendWindowTiles(tiles, captureTime); }, Qt::QueuedConnection);
+        return;
+    }
+    if(SS_JOINED != sessionState_)
+        return;
+    if(tiles.isEmpty() || !(features_ & (SF_DELTA_FRAMES | SF_TILED_FRAMES)))
+        return;
+
+    sendWindowFrame(SC_WINDOW_TILES, tiles, captureTime);
+}
+
+void RemoteWindowSocket::sendWindowShared(const QByteArray &notification, qint64 captureTime)
+{
+    if(QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, [this, notification, captureTime]() { sendWindowShared(notification, captureTime); }, Qt::QueuedConnection);
+        return;
+    }
+    if(SS_JOINED != sessionState_)
+        return;
+    if(notification.isEmpty() || !features_.testFlag(SF_SHARED_MEMORY_FRAMES))
+        return;
+
+    sendWindowFrame(SC_WINDOW_SHARED, notification, captureTime);
+}
+
+void RemoteWindowSocket::sendKeyFrameRequest()
+{
+    if(SS_JOINED != sessionState_)
+        return;
+
+    sendMessage(SC_KEY_FRAME_REQUEST);
+}
+
+void RemoteWindowSocket::sendMouseMove(const QPoint &position)
 {
     if(SS_JOINED != sessionState_)
         return;
-    if(compressed.isEmpty())
+
+    if(features_.testFlag(SF_INPUT_BATCHES)) {
+        InputEvent event;
+        event.command = SC_MOUSE_MOVE;
+        event.code = 0;
+        event.position = position;
+        event.modifiers = 0;
+        queueInputEvent(event);
+        return;
+    }
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << position;
+
+    sendMessage(SC_MOUSE_MOVE, data);
+}
+
+void RemoteWindowSocket::sendMousePress(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+{
+    if(SS_JOINED != sessionState_)
+        return;
+
+    sendMouseEvent(SC_MOUSE_PRESS, button, position, modifiers);
+}
+
+void RemoteWindowSocket::sendMouseRelease(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+{
+    if(SS_JOINED != sessionState_)
+        return;
+
+    sendMouseEvent(SC_MOUSE_RELEASE, button, position, modifiers);
+}
+
+void RemoteWindowSocket::sendMouseClick(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+{
+    if(SS_JOINED != sessionState_)
+        return;
+
+    sendMouseEvent(SC_MOUSE_CLICK, button, position, modifiers);
+}
+
+void RemoteWindowSocket::sendKeyPress(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers)
+{
+    if(SS_JOINED != sessionState_)
+        return;
+
+    sendKeyEvent(SC_KEY_PRESS, key, modifiers);
+}
+
+void RemoteWindowSocket::sendKeyRelease(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers)
+{
+    if(SS_JOINED != sessionState_)
+        return;
+
+    sendKeyEvent(SC_KEY_RELEASE, key, modifiers);
+}
+
+void RemoteWindowSocket::sendChatMessage(QString msg)
+{
+    if(SS_JOINED != sessionState_)
+        return;
+
+    sendMessage(SC_CHAT_MESSAGE, chatMessagePayload(msg));
+}
+
+void RemoteWindowSocket::broadcastChatMessage(const QList<RemoteWindowSocket *> &sockets, QString msg)
+{
+    // Serialized once, every socket writes from the same shared payload
+    const QByteArray data = chatMessagePayload(msg);
+
+    for(RemoteWindowSocket *socket : sockets) {
+        if(QThread::currentThread() != socket->thread()) {
+            QMetaObject::invokeMethod(socket, [socket, data]() {
+                if(SS_JOINED == socket->sessionState_)
+                    socket->sendMessage(SC_CHAT_MESSAGE, data);
+            }, Qt::QueuedConnection);
+        } else if(SS_JOINED == socket->sessionState_)
+            socket->sendMessage(SC_CHAT_MESSAGE, data);
+    }
+}
+
+QByteArray RemoteWindowSocket::chatMessagePayload(QString msg)
+{
+    if(msg.size() > CHAT_MSG_MAX_SIZE) {
+        msg.chop(msg.size() - CHAT_MSG_MAX_SIZE);
+        msg.append("...");
+    }
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << msg;
+    return data;
+}
+
+void RemoteWindowSocket::writeFrameHeader(char *dst, const FrameHeader &header)
+{
+    uchar *udst = reinterpret_cast<uchar *>(dst);
+
+    qToBigEndian<quint16>(header.magic, udst);
+    udst[2] = header.version;
+    udst[3] = header.command;
+    udst[4] = header.flags;
+    udst[5] = header.codec;
+    qToBigEndian<quint16>(header.stream, udst + 6);
+    qToBigEndian<quint32>(header.payloadSize, udst + 8);
+}
+
+RemoteWindowSocket::FrameHeader RemoteWindowSocket::readFrameHeader(const char *src)
+{
+    const uchar *usrc = reinterpret_cast<const uchar *>(src);
+    FrameHeader header;
+
+    header.magic = qFromBigEndian<quint16>(usrc);
+    header.version = usrc[2];
+    header.command = usrc[3];
+    header.flags = usrc[4];
+    header.codec = usrc[5];
+    header.stream = qFromBigEndian<quint16>(usrc + 6);
+    header.payloadSize = qFromBigEndian<quint32>(usrc + 8);
+    return header;
+}
+
+void RemoteWindowSocket::writeDatagramHeader(char *dst, const DatagramHeader &header)
+{
+    uchar *udst = reinterpret_cast<uchar *>(dst);
+
+    qToBigEndian<quint16>(header.magic, udst);
+    udst[2] = header.command;
+    udst[3] = header.codec;
+    qToBigEndian<quint32>(header.sequence, udst + 4);
+    qToBigEndian<quint32>(header.frame, udst + 8);
+    qToBigEndian<quint16>(header.index, udst + 12);
+    qToBigEndian<quint16>(header.count, udst + 14);
+}
+
+RemoteWindowSocket::DatagramHeader RemoteWindowSocket::readDatagramHeader(const char *src)
+{
+    const uchar *usrc = reinterpret_cast<const uchar *>(src);
+    DatagramHeader header;
+
+    header.magic = qFromBigEndian<quint16>(usrc);
+    header.command = usrc[2];
+    header.codec = usrc[3];
+    header.sequence = qFromBigEndian<quint32>(usrc + 4);
+    header.frame = qFromBigEndian<quint32>(usrc + 8);
+    header.index = qFromBigEndian<quint16>(usrc + 12);
+    header.count = qFromBigEndian<quint16>(usrc + 14);
+    return header;
+}
+
+bool RemoteWindowSocket::sendMessage(const SocketCommand &command, const QByteArray &data, quint8 codec)
+{
+    // Frames are counted when they leave the pending slot, that is where they may have waited
+    if(MC_FRAME != messageClass(command))
+        countSentMessage(messageClass(command), timestamp());
+
+    bool sent = WF_BINARY == wireFormat_ ? sendBinaryMessage(command, QByteArray(), data, codec) : sendLegacyMessage(command, QByteArray(), data);
+
+    updateStatus();
+    return sent;
+}
+
+bool RemoteWindowSocket::sendWindowFrameMessage(const Message &frame)
+{
+    bool sent = WF_BINARY == wireFormat_ ? sendBinaryMessage(frame.command, frame.prefix, frame.payload, frame.codec) : sendLegacyMessage(frame.command, frame.prefix, frame.payload);
+
+    updateStatus();
+    return sent;
+}
+
+bool RemoteWindowSocket::sendLegacyMessage(const SocketCommand &command, const QByteArray &prefix, const QByteArray &data)
+{
+    QByteArray header;
+
+    header.append(MESSAGE_START_MARKER);
+    header.append(QString::number(command).toUtf8().toBase64());
+    header.append(MESSAGE_PAYLOAD_SIZE_MARKER);
+    header.append(QString::number(prefix.size() + data.size()).toUtf8().toBase64());
+    header.append(MESSAGE_PAYLOAD_MARKER);
+    if(write(header) != header.size())
+        return false;
+    if(!prefix.isEmpty() && write(prefix) != prefix.size())
+        return false;
+    if(!data.isEmpty() && write(data) != data.size())
+        return false;
+    return putChar(MESSAGE_END_MARKER);
+}
+
+bool RemoteWindowSocket::sendBinaryMessage(const SocketCommand &command, const QByteArray &prefix, const QByteArray &data, quint8 codec)
+{
+    FrameHeader header;
+    header.magic = FRAME_MAGIC;
+    header.version = FRAME_VERSION;
+    header.command = static_cast<quint8>(command);
+    header.flags = FF_NONE;
+    header.codec = codec;
+    header.stream = 0;
+    header.payloadSize = static_cast<quint32>(prefix.size() + data.size());
+
+    char raw[FRAME_HEADER_SIZE];
+    writeFrameHeader(raw, header);
+
+    // Header, prefix and payload are written as separate segments. The payload is shared by every client
+    // the frame is broadcast to and never copied into a message of its own, it goes straight to the socket.
+    if(write(raw, FRAME_HEADER_SIZE) != FRAME_HEADER_SIZE)
+        return false;
+    if(!prefix.isEmpty() && write(prefix) != prefix.size())
+        return false;
+    return data.isEmpty() || write(data) == data.size();
+}
+
+bool RemoteWindowSocket::sendFragment(const Message &frame, int offset, int size, bool last)
+{
+    FrameHeader header;
+    header.magic = FRAME_MAGIC;
+    header.version = FRAME_VERSION;
+    header.command = static_cast<quint8>(frame.command);
+    header.flags = static_cast<quint8>(FF_FRAGMENT | (last ? FF_LAST_FRAGMENT : FF_NONE));
+    header.codec = frame.codec;
+    header.stream = outgoingStream_;
+    header.payloadSize = static_cast<quint32>(size);
+
+    char raw[FRAME_HEADER_SIZE];
+    writeFrameHeader(raw, header);
+
+    if(write(raw, FRAME_HEADER_SIZE) != FRAME_HEADER_SIZE)
+        return false;
+
+    // A fragment may start in the prefix and run on into the payload
+    const int prefixSize = frame.prefix.size();
+    if(offset < prefixSize) {
+        const int count = qMin(size, prefixSize - offset);
+        if(write(frame.prefix.constData() + offset, count) != count)
+            return false;
+        offset += count;
+        size -= count;
+    }
+    return 0 == size || write(frame.payload.constData() + offset - prefixSize, size) == size;
+}
+
+int RemoteWindowSocket::messageSize(const Message &message)
+{
+    return message.prefix.size() + message.payload.size();
+}
+
+void RemoteWindowSocket::copyMessageData(char *dst, const Message &message, int offset, int size)
+{
+    const int prefixSize = message.prefix.size();
+    if(offset < prefixSize) {
+        const int count = qMin(size, prefixSize - offset);
+        memcpy(dst, message.prefix.constData() + offset, static_cast<size_t>(count));
+        dst += count;
+        offset += count;
+        size -= count;
+    }
+    if(size > 0)
+        memcpy(dst, message.payload.constData() + offset - prefixSize, static_cast<size_t>(size));
+}
+
+void RemoteWindowSocket::readMessage()
+{
+    // Bytes are left in the socket's own read buffer until a complete header can be peeked, the payload
+    // is then read straight into a buffer of the announced size. Progress is kept across readyRead signals,
+    // so no byte is ever scanned or moved twice. Both wire formats are accepted at all times, the first
+    // byte of a frame tells them apart. The handshake only decides which format we send.
+    const char magicFirst = static_cast<char>(FRAME_MAGIC >> 8);
+    bool exit = false;
+
+    while(!exit) {
+        switch(parserState_) {
+            case PS_READ_FRAME_START: {
+                char first;
+
+                if(peek(&first, 1) != 1)
+                    exit = true;
+                else if(magicFirst == first)
+                    parserState_ = PS_READ_BINARY_HEADER;
+                else if(MESSAGE_START_MARKER == first)
+                    parserState_ = PS_READ_LEGACY_HEADER;
+                else
+                    discardByte();
+                break;
+            }
+            case PS_READ_BINARY_HEADER: {
+                char raw[FRAME_HEADER_SIZE];
+
+                if(peek(raw, FRAME_HEADER_SIZE) != FRAME_HEADER_SIZE) {
+                    exit = true;
+                    break;
+                }
+
+                FrameHeader header = readFrameHeader(raw);
+                if(FRAME_MAGIC != header.magic || FRAME_VERSION != header.version || header.payloadSize > static_cast<quint32>(PAYLOAD_MAX_SIZE)) {
+                    discardByte();
+                    parserState_ = PS_READ_FRAME_START;
+                    break;
+                }
+
+                read(raw, FRAME_HEADER_SIZE);
+                if(header.flags & FF_FRAGMENT)
+                    beginFragment(header);
+                else
+                    beginPayload(static_cast<SocketCommand>(header.command), header.codec, static_cast<int>(header.payloadSize), false);
+                break;
+            }
+            case PS_READ_LEGACY_HEADER: {
+                char raw[LEGACY_HEADER_MAX_SIZE];
+                qint64 size = peek(raw, LEGACY_HEADER_MAX_SIZE);
+                QByteArray header = QByteArray::fromRawData(raw, static_cast<int>(size));
+                int indexOfPayloadSize = header.indexOf(MESSAGE_PAYLOAD_SIZE_MARKER);
+                int indexOfPayload = header.indexOf(MESSAGE_PAYLOAD_MARKER);
+
+                if(indexOfPayload < 0 && size < LEGACY_HEADER_MAX_SIZE) {
+                    exit = true; // Header not complete yet
+                    break;
+                }
+
+                bool commandOk = false;
+                bool payloadSizeOk = false;
+                int command = 0;
+                int payloadSize = 0;
+
+                if(indexOfPayloadSize > 0 && indexOfPayload > indexOfPayloadSize) {
+                    command = QByteArray::fromBase64(header.mid(1, indexOfPayloadSize - 1)).toInt(&commandOk);
+                    payloadSize = QByteArray::fromBase64(header.mid(indexOfPayloadSize + 1, indexOfPayload - indexOfPayloadSize - 1)).toInt(&payloadSizeOk);
+                }
+
+                if(!commandOk || !payloadSizeOk || payloadSize < 0 || payloadSize > PAYLOAD_MAX_SIZE) {
+                    discardByte();
+                    parserState_ = PS_READ_FRAME_START;
+                    break;
+                }
+
+                read(raw, indexOfPayload + 1);
+                beginPayload(static_cast<SocketCommand>(command), RemoteWindowCodec::CI_JPEG_ZLIB, payloadSize, true);
+                break;
+            }
+            case PS_READ_PAYLOAD: {
+                int remaining = pending_.payload.size() - payloadRead_;
+
+                if(remaining > 0) {
+                    qint64 count = read(pending_.payload.data() + payloadRead_, remaining);
+                    if(count <= 0) {
+                        exit = true;
+                        break;
+                    }
+                    payloadRead_ += static_cast<int>(count);
+                }
+
+                if(payloadRead_ == pending_.payload.size()) {
+                    if(pendingLegacy_)
+                        parserState_ = PS_READ_LEGACY_END;
+                    else
+                        finishPayload();
+                }
+                break;
+            }
+            case PS_READ_LEGACY_END: {
+                char end;
+
+                if(!getChar(&end))
+                    exit = true;
+                else if(MESSAGE_END_MARKER == end)
+                    finishPayload();
+                else {
+                    // The frame turned out to be bogus, drop it
+                    discardedByteCount_ += static_cast<quint64>(pending_.payload.size()) + 1;
+                    resyncCount_++;
+                    resyncing_ = true;
+                    pending_.payload = QByteArray();
+                    parserState_ = PS_READ_FRAME_START;
+                }
+                break;
+            }
+        }
+    }
+}
+
+void RemoteWindowSocket::beginPayload(const SocketCommand &command, quint8 codec, int size, bool legacy)
+{
+    pending_.command = command;
+    pending_.codec = codec;
+    pending_.payload = QByteArray(size, Qt::Uninitialized);
+    pendingLegacy_ = legacy;
+    pendingFragment_ = false;
+    payloadRead_ = 0;
+    resyncing_ = false;
+    parserState_ = PS_READ_PAYLOAD;
+}
+
+void RemoteWindowSocket::beginFragment(const FrameHeader &header)
+{
+    // Fragments of a stream are read straight onto the end of what was assembled so far. A fragment of
+    // another stream means the sender gave up on the one we were assembling, usually for a newer frame.
+    if(hasFragments_ && (fragmentStream_ != header.stream || fragments_.command != header.command)) {
+        receiveCounters_[messageClass(fragments_.command)].dropped++;
+        fragments_.payload = QByteArray();
+        hasFragments_ = false;
+    }
+    if(!hasFragments_) {
+        fragments_.command = static_cast<SocketCommand>(header.command);
+        fragments_.codec = header.codec;
+        fragmentStream_ = header.stream;
+        hasFragments_ = true;
+    }
+
+    const int offset = fragments_.payload.size();
+    if(static_cast<quint32>(PAYLOAD_MAX_SIZE - offset) < header.payloadSize) {
+        // Can never become a valid message, read past the fragment and forget the stream
+        receiveCounters_[messageClass(fragments_.command)].dropped++;
+        fragments_.payload = QByteArray();
+        hasFragments_ = false;
+        beginPayload(SC_UNKNOWN, header.codec, static_cast<int>(header.payloadSize), false);
+        return;
+    }
+
+    pending_.command = fragments_.command;
+    pending_.codec = fragments_.codec;
+    pending_.payload.swap(fragments_.payload);
+    pending_.payload.resize(offset + static_cast<int>(header.payloadSize));
+    pendingLegacy_ = false;
+    pendingFragment_ = true;
+    pendingLastFragment_ = 0 != (header.flags & FF_LAST_FRAGMENT);
+    payloadRead_ = offset;
+    resyncing_ = false;
+    parserState_ = PS_READ_PAYLOAD;
+}
+
+void RemoteWindowSocket::finishPayload()
+{
+    if(pendingFragment_ && !pendingLastFragment_)
+        fragments_.payload.swap(pending_.payload); // More to come
+    else {
+        if(pendingFragment_)
+            hasFragments_ = false;
+        enqueueMessage(pending_);
+    }
+    pendingFragment_ = false;
+    pending_.payload = QByteArray();
+    parserState_ = PS_READ_FRAME_START;
+}
+
+void RemoteWindowSocket::discardByte()
+{
+    getChar(nullptr);
+    discardedByteCount_++;
+    if(!resyncing_) {
+        resyncing_ = true;
+        resyncCount_++;
+    }
+}
+
+void RemoteWindowSocket::resetParser()
+{
+    parserState_ = PS_READ_FRAME_START;
+    pending_.command = SC_UNKNOWN;
+    pending_.codec = RemoteWindowCodec::CI_JPEG_ZLIB;
+    pending_.payload = QByteArray();
+    pendingLegacy_ = false;
+    pendingFragment_ = false;
+    pendingLastFragment_ = false;
+    fragments_.payload = QByteArray();
+    hasFragments_ = false;
+    payloadRead_ = 0;
+    resyncing_ = false;
+}
+
+void RemoteWindowSocket::enqueueMessage(Message msg)
+{
+    // Control and input are never dropped. process() drains them after every read, so they can't pile up
+    // beyond what a single read delivers. Frames are the only ones that may go, and only for a newer frame.
+    const MessageClass type = messageClass(msg.command);
+
+    msg.time = timestamp();
+    receiveCounters_[type].messages++;
+    if(MC_INPUT == type && inputTime_ < 0 && features_.testFlag(SF_FRAME_TIMING))
+        inputTime_ = msg.time;
+    if(MC_FRAME != type) {
+        messageQueue_.enqueue(msg);
+        return;
+    }
+
+    if(SC_WINDOW_DELTA != msg.command) {
+        // A key frame replaces the whole image, whatever was queued before it is superseded
+        receiveCounters_[MC_FRAME].dropped += static_cast<quint64>(frameQueue_.count());
+        frameQueue_.clear();
+        awaitingKeyFrame_ = false;
+    } else if(awaitingKeyFrame_ || frameQueue_.count() >= QUEUE_MAX_SIZE) {
+        // Deltas build on each other, once one is gone the rest is useless until the next key frame
+        receiveCounters_[MC_FRAME].dropped += static_cast<quint64>(frameQueue_.count()) + 1;
+        frameQueue_.clear();
+        if(!awaitingKeyFrame_) {
+            awaitingKeyFrame_ = true;
+            sendKeyFrameRequest();
+        }
+        return;
+    }
+    frameQueue_.enqueue(msg);
+}
+
+bool RemoteWindowSocket::dequeueMessage()
+{
+    // Control and input go first, frames only once nothing else is waiting
+    QQueue<Message> &queue = messageQueue_.isEmpty() ? frameQueue_ : messageQueue_;
+    if(queue.isEmpty())
+        return false;
+
+    message_ = queue.dequeue();
+
+    QueueCounters &counters = receiveCounters_[messageClass(message_.command)];
+    const qint64 delay = timestamp() - message_.time;
+    counters.totalDelay += delay;
+    counters.maxDelay = qMax(counters.maxDelay, delay);
+    return true;
+}
+
+void RemoteWindowSocket::countSentMessage(MessageClass messageClass, qint64 queueTime)
+{
+    // Whatever is in the socket's buffer already goes out first, estimate how long that takes
+    QueueCounters &counters = sendCounters_[messageClass];
+    qint64 delay = timestamp() - queueTime;
+
+    if(throughput_ > 0)
+        delay += bytesToWrite() * 1000000 / throughput_;
+    counters.messages++;
+    counters.totalDelay += delay;
+    counters.maxDelay = qMax(counters.maxDelay, delay);
+}
+
+qint64 RemoteWindowSocket::timestamp()
+{
+    return QDeadlineTimer::current(Qt::PreciseTimer).deadlineNSecs() / 1000;
+}
+
+RemoteWindowSocket::MessageClass RemoteWindowSocket::messageClass(const SocketCommand &command)
+{
+    switch(command) {
+        default:
+            return MC_CONTROL;
+        case SC_MOUSE_MOVE:
+        case SC_MOUSE_PRESS:
+        case SC_MOUSE_RELEASE:
+        case SC_MOUSE_CLICK:
+        case SC_KEY_PRESS:
+        case SC_KEY_RELEASE:
+        case SC_INPUT_BATCH:
+            return MC_INPUT;
+        case SC_WINDOW_CAPTURE:
+        case SC_WINDOW_DELTA:
+        case SC_WINDOW_TILES:
+        case SC_WINDOW_SHARED:
+            return MC_FRAME;
+    }
+}
+
+void RemoteWindowSocket::sendJoinSession()
+{
+    // Legacy peers ignore the payload of a join, so advertising the binary wire format is harmless
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+
+    SessionFeatures requested = requestedFeatures_;
+    quint16 datagramPort = 0;
+
+    // Tiled key frames are composed into the window image and never reach windowCaptureReceived(), a peer
+    // that only listens to that one needs its key frames whole
+    if(!isSignalConnected(QMetaMethod::fromSignal(&RemoteWindowSocket::windowImageUpdated))
+            && !isSignalConnected(QMetaMethod::fromSignal(&RemoteWindowSocket::windowImageReceived)))
+        requested.setFlag(SF_TILED_FRAMES, false);
+
+    // The frames come in on the address the session runs on, the peer needs our port to send them to
+    if(requested.testFlag(SF_DATAGRAM_FRAMES) && udpSocket_->bind(localAddress(), 0)) {
+        udpSocket_->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, DATAGRAM_BUFFER_SIZE);
+        datagramPort = udpSocket_->localPort();
+    }
+
+    stream << FRAME_MAGIC << FRAME_VERSION << static_cast<quint32>(requested) << preferredCodecs_ << datagramPort
+           << viewportSize_ << preferredQuality_;
+    sendMessage(SC_JOIN_SESSION, data);
+}
+
+void RemoteWindowSocket::sendJoinSessionAck(quint8 version, SessionFeatures features, quint8 codec)
+{
+    QByteArray data;
+
+    if(version > 0) {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream << FRAME_MAGIC << version << static_cast<quint32>(features) << codec;
+    }
+    sendMessage(SC_JOIN_SESSION_ACK, data);
+}
+
+void RemoteWindowSocket::sendLeaveSession()
+{
+    sendMessage(SC_LEAVE_SESSION);
+}
+
+void RemoteWindowSocket::sendMouseEvent(const SocketCommand &command, const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+{
+    if(features_.testFlag(SF_INPUT_BATCHES)) {
+        InputEvent event;
+        event.command = command;
+        event.code = static_cast<int>(button);
+        event.position = position;
+        event.modifiers = static_cast<int>(modifiers);
+        queueInputEvent(event);
+        return;
+    }
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+
+    stream << static_cast<int>(button) << position << static_cast<int>(modifiers);
+    sendMessage(command, data);
+}
+
+void RemoteWindowSocket::sendKeyEvent(const SocketCommand &command, const Qt::Key &key, const Qt::KeyboardModifiers &modifiers)
+{
+    if(features_.testFlag(SF_INPUT_BATCHES)) {
+        InputEvent event;
+        event.command = command;
+        event.code = static_cast<int>(key);
+        event.modifiers = static_cast<int>(modifiers);
+        queueInputEvent(event);
+        return;
+    }
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+
+    stream << static_cast<int>(key) << static_cast<int>(modifiers);
+    sendMessage(command, data);
+}
+
+void RemoteWindowSocket::queueInputEvent(const InputEvent &event)
+{
+    // Only the latest position of a run of moves matters, anything else keeps its place in the batch
+    if(SC_MOUSE_MOVE == event.command && !inputBatch_.isEmpty() && SC_MOUSE_MOVE == inputBatch_.last().command) {
+        inputBatch_.last() = event;
+        coalescedMoveCount_++;
+    } else
+        inputBatch_.append(event);
+
+    if(inputBatch_.count() >= INPUT_BATCH_MAX_SIZE) {
+        flushInputBatch();
+        return;
+    }
+
+    // Moves may wait for the batch delay, buttons and keys go out on the next event loop turn
+    int delay = SC_MOUSE_MOVE == event.command ? inputBatchDelay_ : 0;
+    if(-1 != inputBatchTimerId_) {
+        if(inputBatchTimerDelay_ <= delay)
+            return;
+        killTimer(inputBatchTimerId_);
+    }
+    inputBatchTimerId_ = startTimer(delay, Qt::PreciseTimer);
+    inputBatchTimerDelay_ = delay;
+}
+
+void RemoteWindowSocket::flushInputBatch()
+{
+    if(-1 != inputBatchTimerId_)
+        killTimer(inputBatchTimerId_);
+    inputBatchTimerId_ = -1;
+
+    if(inputBatch_.isEmpty())
+        return;
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+
+    stream << static_cast<quint32>(inputBatch_.count());
+    for(const InputEvent &event : inputBatch_) {
+        stream << static_cast<quint8>(event.command);
+        switch(event.command) {
+            default:
+                break;
+            case SC_MOUSE_MOVE:
+                stream << event.position;
+                break;
+            case SC_MOUSE_PRESS:
+            case SC_MOUSE_RELEASE:
+            case SC_MOUSE_CLICK:
+                stream << event.code << event.position << event.modifiers;
+                break;
+            case SC_KEY_PRESS:
+            case SC_KEY_RELEASE:
+                stream << event.code << event.modifiers;
+                break;
+        }
+    }
+    inputBatch_.clear();
+    sendMessage(SC_INPUT_BATCH, data);
+}
+
+void RemoteWindowSocket::resetInputBatch()
+{
+    if(-1 != inputBatchTimerId_)
+        killTimer(inputBatchTimerId_);
+    inputBatchTimerId_ = -1;
+    inputBatch_.clear();
+}
+
+void RemoteWindowSocket::applyInputBatch(const QByteArray &batch)
+{
+    QList<InputEvent> events;
+    quint32 count = 0;
+    QDataStream stream(batch);
+
+    stream >> count;
+    for(quint32 i = 0; i < count && QDataStream::Ok == stream.status(); ++i) {
+        quint8 command = SC_UNKNOWN;
+        InputEvent event;
+
+        stream >> command;
+        event.command = static_cast<SocketCommand>(command);
+        event.code = 0;
+        event.modifiers = 0;
+        switch(event.command) {
+            default:
+                stream.setStatus(QDataStream::ReadCorruptData); // Can't skip what we don't know the size of
+                break;
+            case SC_MOUSE_MOVE:
+                stream >> event.position;
+                break;
+            case SC_MOUSE_PRESS:
+            case SC_MOUSE_RELEASE:
+            case SC_MOUSE_CLICK:
+                stream >> event.code >> event.position >> event.modifiers;
+                break;
+            case SC_KEY_PRESS:
+            case SC_KEY_RELEASE:
+                stream >> event.code >> event.modifiers;
+                break;
+        }
+        if(QDataStream::Ok == stream.status())
+            events.append(event);
+    }
+
+    // A move that is directly followed by another one is stale, the order of everything else is kept as is
+    for(int i = 0; i < events.count(); ++i) {
+        if(SC_MOUSE_MOVE == events.at(i).command && i + 1 < events.count() && SC_MOUSE_MOVE == events.at(i + 1).command) {
+            coalescedMoveCount_++;
+            continue;
+        }
+        emitInputEvent(events.at(i));
+    }
+}
+
+void RemoteWindowSocket::emitInputEvent(const InputEvent &event)
+{
+    switch(event.command) {
+        default:
+            break;
+        case SC_MOUSE_MOVE:
+            emit mouseMoveReceived(event.position);
+            break;
+        case SC_MOUSE_PRESS:
+            emit mousePressReceived(static_cast<Qt::MouseButton>(event.code), event.position, static_cast<Qt::KeyboardModifiers>(event.modifiers));
+            break;
+        case SC_MOUSE_RELEASE:
+            emit mouseReleaseReceived(static_cast<Qt::MouseButton>(event.code), event.position, static_cast<Qt::KeyboardModifiers>(event.modifiers));
+            break;
+        case SC_MOUSE_CLICK:
+            emit mouseClickReceived(static_cast<Qt::MouseButton>(event.code), event.position, static_cast<Qt::KeyboardModifiers>(event.modifiers));
+            break;
+        case SC_KEY_PRESS:
+            emit keyPressReceived(static_cast<Qt::Key>(event.code), static_cast<Qt::KeyboardModifiers>(event.modifiers));
+            break;
+        case SC_KEY_RELEASE:
+            emit keyReleaseReceived(static_cast<Qt::Key>(event.code), static_cast<Qt::KeyboardModifiers>(event.modifiers));
+            break;
+    }
+}
+
+void RemoteWindowSocket::timerEvent(QTimerEvent *event)
+{
+    if(event->timerId() == inputBatchTimerId_)
+        flushInputBatch();
+    else if(event->timerId() == pingTimerId_)
+        sendPing();
+    else if(event->timerId() == readTimerId_)
+        process();
+    else if(event->timerId() == datagramPacingTimerId_)
+        pumpDatagrams();
+    else if(event->timerId() == datagramTimerId_) {
+        killTimer(datagramTimerId_);
+        datagramTimerId_ = -1;
+        if(hasDatagramFrame_ && datagramChunksReceived_ < datagramChunks_.count()) {
+            // Late parts of it are ignored from here on, the frame count no longer matches
+            datagramChunks_.clear();
+            datagramChunksReceived_ = 0;
+            datagramFrameLost();
+        }
+    }
+    else
+        QTcpSocket::timerEvent(event);
+}
+
+void RemoteWindowSocket::setSessionState(const SessionState &value)
+{
+    if(sessionState_ != value) {
+        sessionState_ = value;
+        if(SS_JOINED == sessionState_ && features_.testFlag(SF_FRAME_TIMING)) {
+            // Ping right away, once the ack is out, so the latencies mean something from the first frame on
+            pingTimerId_ = startTimer(PING_INTERVAL);
+            QMetaObject::invokeMethod(this, [this]() { sendPing(); }, Qt::QueuedConnection);
+        }
+        updateStatus();
+        emit sessionStateChanged();
+    }
+}
+
+void RemoteWindowSocket::updateStatus()
+{
+    QMutexLocker locker(&statusMutex_);
+
+    status_.sessionState = sessionState_;
+    status_.features = features_;
+    status_.codec = codec_;
+    if(!peerAddress().isNull())
+        status_.peerAddress = peerAddress(); // Kept after a disconnect, so it can still be reported
+    status_.bytesToWrite = bytesToWrite() + (hasOutgoing_ ? messageSize(outgoing_) - outgoingOffset_ : 0);
+    status_.drainTime = drainTime_;
+    status_.throughput = throughput_;
+    status_.frameBacklog = hasPendingFrame_ || !pendingDeltas_.isEmpty() || hasOutgoing_ || !datagramQueue_.isEmpty()
+                        || bytesToWrite() > writeBufferThreshold_;
+    status_.roundTripTime = roundTripTime_;
+    status_.frameLatency = frameLatency_;
+    status_.inputLatency = inputLatency_;
+    status_.viewportSize = viewportSize_;
+    status_.preferredQuality = preferredQuality_;
+    statusDrainStart_ = drainStart_;
+
+    // Plain counters, updated wherever they happen and only published here
+    writeBufferHighWater_ = qMax(writeBufferHighWater_, status_.bytesToWrite);
+    metrics_.bytesReceived = bytesReceived_;
+    metrics_.bytesSent = bytesSent_;
+    metrics_.messagesReceived = 0;
+    metrics_.messagesSent = 0;
+    for(int i = MC_CONTROL; i <= MC_FRAME; ++i) {
+        metrics_.messagesReceived += receiveCounters_[i].messages;
+        metrics_.messagesSent += sendCounters_[i].messages;
+    }
+    metrics_.framesReceived = receiveCounters_[MC_FRAME].messages;
+    metrics_.framesSent = sendCounters_[MC_FRAME].messages;
+    metrics_.framesSkipped = sendCounters_[MC_FRAME].dropped;
+    metrics_.framesDropped = receiveCounters_[MC_FRAME].dropped;
+    metrics_.decodesSkipped = decoder_->droppedJobCount();
+    metrics_.resyncs = resyncCount_;
+    metrics_.discardedBytes = discardedByteCount_;
+    metrics_.writeBufferHighWater = writeBufferHighWater_;
+    metrics_.framesAcknowledged = framesAcknowledged_;
+    metrics_.roundTripTime = roundTripTime_;
+    metrics_.frameLatency = frameLatency_;
+    metrics_.inputLatency = inputLatency_;
+}
+
+void RemoteWindowSocket::sendWindowFrame(const SocketCommand &command, const QByteArray &frameData, qint64 captureTime)
+{
+    // The frame data is shared by every client it is broadcast to, only the timing is this socket's own
+    Message frame;
+    frame.command = command;
+    frame.codec = codec_;
+    if(features_.testFlag(SF_FRAME_TIMING))
+        frame.prefix = frameTiming(captureTime);
+    frame.payload = frameData;
+    frame.time = timestamp();
+
+    if(features_.testFlag(SF_DATAGRAM_FRAMES)) {
+        sendDatagramFrame(frame);
+        return;
+    }
+    if(features_.testFlag(SF_CHUNKED_FRAMES)) {
+        sendFragmentedWindowFrame(frame);
         return;
+    }
+
+    // Latest frame wins: while the peer is still draining earlier data, newer key frames replace the one
+    // waiting here instead of queueing up behind it. A delta depends on every frame before it, so it can't
+    // be replaced, it queues behind the frame it builds on instead.
+    const bool congested = bytesToWrite() > writeBufferThreshold_;
+
+    if(SC_WINDOW_DELTA == frame.command) {
+        if(deltaChainBroken_) {
+            sendCounters_[MC_FRAME].dropped++;
+            return;
+        }
+        if(hasPendingFrame_ || !pendingDeltas_.isEmpty() || congested) {
+            queueDelta(frame);
+            return;
+        }
+    } else {
+        deltaChainBroken_ = false;
+        dropPendingDeltas(); // A key frame replaces everything before it
+        if(congested) {
+            if(hasPendingFrame_)
+                sendCounters_[MC_FRAME].dropped++;
+            pendingFrame_ = frame;
+            hasPendingFrame_ = true;
+            return;
+        }
+        if(hasPendingFrame_) {
+            sendCounters_[MC_FRAME].dropped++;
+            resetPendingFrame();
+        }
+    }
 
-    sendMessage(SC_WINDOW_CAPTURE, compressed);
+    writeWindowFrame(frame);
 }
 
-void RemoteWindowSocket::sendMouseMove(const QPoint &position)
+void RemoteWindowSocket::sendFragmentedWindowFrame(const Message &frame)
 {
-    if(SS_JOINED != sessionState_)
-        return;
+    // The frame in flight goes out fragment by fragment, so anything else only waits for the fragments
+    // already handed to the socket. A newer key frame cancels it when less than half of it is out, but
+    // never twice in a row, otherwise a slow link would never complete a frame at all. Deltas queue behind it.
+    if(SC_WINDOW_DELTA == frame.command) {
+        if(deltaChainBroken_) {
+            sendCounters_[MC_FRAME].dropped++;
+            return;
+        }
+        if(hasOutgoing_ || hasPendingFrame_ || !pendingDeltas_.isEmpty()) {
+            queueDelta(frame);
+            return;
+        }
+    } else {
+        deltaChainBroken_ = false;
+        dropPendingDeltas(); // A key frame replaces everything before it
+        if(hasPendingFrame_) {
+            sendCounters_[MC_FRAME].dropped++;
+            resetPendingFrame();
+        }
 
-    QByteArray data;
-    QDataStream stream(&data, QIODevice::WriteOnly);
-    stream << position;
+        bool cancel = hasOutgoing_ && !outgoingProtected_ && outgoingOffset_ < messageSize(outgoing_) / 2;
+        if(hasOutgoing_ && !cancel) {
+            pendingFrame_ = frame;
+            hasPendingFrame_ = true;
+            return;
+        }
+        if(cancel) {
+            // The peer drops what it has of it as soon as the next stream starts
+            sendCounters_[MC_FRAME].dropped++;
+            hasOutgoing_ = false;
+            outgoing_.payload = QByteArray();
+        }
+        outgoingProtected_ = cancel;
+    }
 
-    sendMessage(SC_MOUSE_MOVE, data);
+    writeWindowFrame(frame);
+    pumpFragments();
 }
 
-void RemoteWindowSocket::sendMousePress(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+void RemoteWindowSocket::writeWindowFrame(const Message &frame)
 {
-    if(SS_JOINED != sessionState_)
+    if(drainStart_ < 0) {
+        drainStart_ = clock_.elapsed();
+        drainBytes_ = 0;
+    }
+    drainBytes_ += messageSize(frame);
+    countSentMessage(MC_FRAME, frame.time);
+
+    if(features_.testFlag(SF_CHUNKED_FRAMES)) {
+        // Sent by pumpFragments()
+        outgoing_ = frame;
+        outgoingOffset_ = 0;
+        outgoingStream_ = nextStream_++;
+        hasOutgoing_ = true;
         return;
+    }
+    sendWindowFrameMessage(frame);
+}
 
-    sendMouseEvent(SC_MOUSE_PRESS, button, position, modifiers);
+void RemoteWindowSocket::pumpFragments()
+{
+    while(bytesToWrite() < FRAGMENT_SIZE) {
+        if(!hasOutgoing_) {
+            Message frame;
+            if(!takePendingFrame(frame))
+                break;
+            writeWindowFrame(frame);
+        }
+
+        const int size = qMin(FRAGMENT_SIZE, messageSize(outgoing_) - outgoingOffset_);
+        const bool last = outgoingOffset_ + size >= messageSize(outgoing_);
+
+        if(!sendFragment(outgoing_, outgoingOffset_, size, last))
+            break;
+        outgoingOffset_ += size;
+        if(last) {
+            hasOutgoing_ = false;
+            outgoingProtected_ = false;
+            outgoing_.payload = QByteArray();
+        }
+    }
+    updateStatus();
 }
 
-void RemoteWindowSocket::sendMouseRelease(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+void RemoteWindowSocket::resetPendingFrame()
 {
-    if(SS_JOINED != sessionState_)
+    pendingFrame_.command = SC_UNKNOWN;
+    pendingFrame_.codec = RemoteWindowCodec::CI_JPEG_ZLIB;
+    pendingFrame_.prefix = QByteArray();
+    pendingFrame_.payload = QByteArray();
+    pendingFrame_.time = 0;
+    hasPendingFrame_ = false;
+    deltaChainBroken_ = false;
+}
+
+void RemoteWindowSocket::queueDelta(const Message &frame)
+{
+    // The sender holds deltas back while there is a backlog, so this only overflows when the link
+    // stopped moving altogether. Then there is no way around starting over with a key frame.
+    if(pendingDeltas_.count() >= PENDING_DELTAS_MAX_SIZE) {
+        dropPendingDeltas();
+        sendCounters_[MC_FRAME].dropped++;
+        deltaChainBroken_ = true;
+        emit keyFrameRequired();
         return;
+    }
+    pendingDeltas_.enqueue(frame);
+}
 
-    sendMouseEvent(SC_MOUSE_RELEASE, button, position, modifiers);
+void RemoteWindowSocket::dropPendingDeltas()
+{
+    sendCounters_[MC_FRAME].dropped += static_cast<quint64>(pendingDeltas_.count());
+    pendingDeltas_.clear();
 }
 
-void RemoteWindowSocket::sendMouseClick(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+bool RemoteWindowSocket::takePendingFrame(Message &frame)
 {
-    if(SS_JOINED != sessionState_)
-        return;
+    // The pending frame is older than any delta queued, they were sent after it and build on it
+    if(hasPendingFrame_) {
+        frame = pendingFrame_;
+        hasPendingFrame_ = false;
+        pendingFrame_.payload = QByteArray();
+        return true;
+    }
+    if(pendingDeltas_.isEmpty())
+        return false;
 
-    sendMouseEvent(SC_MOUSE_CLICK, button, position, modifiers);
+    frame = pendingDeltas_.dequeue();
+    return true;
 }
 
-void RemoteWindowSocket::sendKeyPress(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers)
+void RemoteWindowSocket::sendDatagramFrame(const Message &frame)
 {
-    if(SS_JOINED != sessionState_)
+    // A frame is never retransmitted, the peer asks for a new one when it notices a loss. The datagrams
+    // are queued and paced out, a frame that doesn't fit behind the ones still queued is left out whole.
+    const int frameSize = messageSize(frame);
+    const int count = (frameSize + DATAGRAM_PAYLOAD_SIZE - 1) / DATAGRAM_PAYLOAD_SIZE;
+    DatagramHeader header;
+
+    if(frameSize > PAYLOAD_MAX_SIZE)
+        return;
+    if(datagramQueueBytes_ > 0 && datagramQueueBytes_ + frameSize + count * DATAGRAM_HEADER_SIZE > DATAGRAM_BUFFER_SIZE) {
+        sendCounters_[MC_FRAME].dropped++;
+        if(SC_WINDOW_DELTA == frame.command)
+            emit keyFrameRequired(); // The chain is broken on the other side either way
         return;
+    }
 
-    sendKeyEvent(SC_KEY_PRESS, key, modifiers);
+    header.magic = FRAME_MAGIC;
+    header.command = static_cast<quint8>(frame.command);
+    header.codec = frame.codec;
+    header.frame = ++nextDatagramFrame_;
+    header.count = static_cast<quint16>(count);
+    for(int i = 0; i < count; ++i) {
+        const int offset = i * DATAGRAM_PAYLOAD_SIZE;
+        const int size = qMin(DATAGRAM_PAYLOAD_SIZE, frameSize - offset);
+
+        QByteArray datagram(DATAGRAM_HEADER_SIZE + size, Qt::Uninitialized);
+
+        header.sequence = ++nextDatagramSequence_;
+        header.index = static_cast<quint16>(i);
+        writeDatagramHeader(datagram.data(), header);
+        copyMessageData(datagram.data() + DATAGRAM_HEADER_SIZE, frame, offset, size);
+        if(dropDatagram())
+            continue;
+        datagramQueue_.enqueue(datagram);
+        datagramQueueBytes_ += datagram.size();
+    }
+
+    // Fast enough to get everything queued out within the pacing interval
+    datagramRate_ = datagramPacing_ > 0 ? qMax(datagramQueueBytes_ * 1000 / datagramPacing_, DATAGRAM_RATE_MIN) : 0;
+    countSentMessage(MC_FRAME, frame.time);
+    pumpDatagrams();
 }
 
-void RemoteWindowSocket::sendKeyRelease(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers)
+void RemoteWindowSocket::pumpDatagrams()
 {
-    if(SS_JOINED != sessionState_)
-        return;
+    const qint64 now = timestamp();
 
-    sendKeyEvent(SC_KEY_RELEASE, key, modifiers);
+    if(datagramRate_ > 0)
+        datagramTokens_ = qMin<qint64>(DATAGRAM_BURST_SIZE, datagramTokens_ + (now - datagramTokenTime_) * datagramRate_ / 1000000);
+    datagramTokenTime_ = now;
+
+    while(!datagramQueue_.isEmpty()) {
+        const QByteArray datagram = datagramQueue_.head();
+        if(datagramRate_ > 0 && datagramTokens_ < datagram.size())
+            break;
+
+        // A full send buffer is no reason to give up on the frame, the next tick tries again
+        const qint64 written = udpSocket_->writeDatagram(datagram, peerAddress(), datagramPort_);
+        if(written < 0 && QAbstractSocket::TemporaryError == udpSocket_->error())
+            break;
+
+        datagramQueue_.dequeue();
+        datagramQueueBytes_ -= datagram.size();
+        if(datagramRate_ > 0)
+            datagramTokens_ -= datagram.size();
+        if(written > 0)
+            bytesSent_ += static_cast<quint64>(written);
+    }
+
+    if(datagramQueue_.isEmpty() && -1 != datagramPacingTimerId_) {
+        killTimer(datagramPacingTimerId_);
+        datagramPacingTimerId_ = -1;
+    } else if(!datagramQueue_.isEmpty() && -1 == datagramPacingTimerId_)
+        datagramPacingTimerId_ = startTimer(DATAGRAM_PACING_INTERVAL, Qt::PreciseTimer);
+    updateStatus();
 }
 
-void RemoteWindowSocket::sendChatMessage(QString msg)
+void RemoteWindowSocket::receiveDatagram(const QByteArray &datagram)
 {
-    if(SS_JOINED != sessionState_)
+    const DatagramHeader header = readDatagramHeader(datagram.constData());
+    const SocketCommand command = static_cast<SocketCommand>(header.command);
+
+    if(FRAME_MAGIC != header.magic || MC_FRAME != messageClass(command))
         return;
-    if(msg.size() > CHAT_MSG_MAX_SIZE) {
-        msg.chop(msg.size() - CHAT_MSG_MAX_SIZE);
-        msg.append("...");
+    if(0 == header.count || header.index >= header.count || header.count > PAYLOAD_MAX_SIZE / DATAGRAM_PAYLOAD_SIZE + 1)
+        return;
+
+    // Sequence numbers only go forward, anything skipped is counted as lost even if it shows up later
+    const qint32 gap = static_cast<qint32>(header.sequence - datagramSequence_);
+    if(hasDatagramFrame_ && gap > 1)
+        lostDatagramCount_ += static_cast<quint64>(gap - 1);
+    if(!hasDatagramFrame_ || gap > 0)
+        datagramSequence_ = header.sequence;
+
+    const qint32 age = static_cast<qint32>(header.frame - datagramFrame_);
+    if(hasDatagramFrame_ && age < 0)
+        return; // Part of a frame that was given up on already
+    if(!hasDatagramFrame_ || age > 0) {
+        // A newer frame started, so the current one is complete or lost for good
+        if(hasDatagramFrame_ && (datagramChunksReceived_ < datagramChunks_.count() || age > 1))
+            datagramFrameLost();
+
+        hasDatagramFrame_ = true;
+        datagramFrame_ = header.frame;
+        datagramMessage_.command = command;
+        datagramMessage_.codec = header.codec;
+        datagramChunks_ = QVector<QByteArray>(header.count);
+        datagramChunksReceived_ = 0;
+        if(-1 != datagramTimerId_)
+            killTimer(datagramTimerId_);
+        datagramTimerId_ = startTimer(DATAGRAM_REASSEMBLY_TIMEOUT);
     }
+    if(header.count != datagramChunks_.count() || !datagramChunks_.at(header.index).isNull())
+        return;
 
-    QByteArray data;
-    QDataStream stream(&data, QIODevice::WriteOnly);
-    stream << msg;
+    datagramChunks_[header.index] = datagram.mid(DATAGRAM_HEADER_SIZE);
+    if(++datagramChunksReceived_ < datagramChunks_.count())
+        return;
 
-    sendMessage(SC_CHAT_MESSAGE, data);
+    killTimer(datagramTimerId_);
+    datagramTimerId_ = -1;
+    datagramMessage_.payload.clear();
+    for(const QByteArray &chunk : datagramChunks_)
+        datagramMessage_.payload.append(chunk);
+    enqueueMessage(datagramMessage_);
+    datagramMessage_.payload = QByteArray();
 }
 
-bool RemoteWindowSocket::sendMessage(const SocketCommand &command, const QByteArray &data)
+void RemoteWindowSocket::datagramFrameLost()
 {
-    QByteArray message;
+    receiveCounters_[MC_FRAME].dropped++;
 
-    message.append(MESSAGE_START_MARKER);
-    message.append(QString::number(command).toUtf8().toBase64());
-    message.append(MESSAGE_PAYLOAD_SIZE_MARKER);
-    message.append(QString::number(data.size()).toUtf8().toBase64());
-    message.append(MESSAGE_PAYLOAD_MARKER);
-    message.append(data);
-    message.append(MESSAGE_END_MARKER);
-    return write(message) == message.size();
+    // Always ask for a new frame, the sender skips unchanged frames so on a static window nothing
+    // would replace the lost one until the keep alive. A delta chain has to start over as well.
+    if(features_.testFlag(SF_DELTA_FRAMES))
+        awaitingKeyFrame_ = true;
+    sendKeyFrameRequest();
 }
 
-void RemoteWindowSocket::readMessage()
+void RemoteWindowSocket::resetDatagrams()
 {
-    // Yeah this kind of sucks, but it works...
-    bool exit;
-
-    do {
-        exit = true;
-        if(buffer_.size() > BUFFER_MAX_SIZE)
-            buffer_.clear();
-        buffer_.append(readAll());
-
-        int indexOfStart = buffer_.indexOf(MESSAGE_START_MARKER);
-        int indexOfPayloadSize = buffer_.indexOf(MESSAGE_PAYLOAD_SIZE_MARKER);
-        int indexOfPayload = buffer_.indexOf(MESSAGE_PAYLOAD_MARKER);
-
-        // Check if message header is present
-        if(indexOfStart >= 0 && indexOfPayloadSize >= 0 && indexOfPayload >= 0) {
-            bool ok = false;
-            int payloadSize = QByteArray::fromBase64(buffer_.mid(indexOfPayloadSize + 1, indexOfPayload - indexOfPayloadSize - 1)).toInt(&ok);
-            int indexOfEnd = indexOfPayload + payloadSize + 1;
-
-            if(ok && indexOfEnd < buffer_.size()) {
-                if(buffer_.at(indexOfEnd) == MESSAGE_END_MARKER) {
-                    Message msg;
-                    msg.command = static_cast<SocketCommand>(QByteArray::fromBase64(buffer_.mid(indexOfStart + 1, indexOfPayloadSize - indexOfStart - 1)).toInt());
-                    msg.payload = buffer_.mid(indexOfPayload + 1, payloadSize);
-
-                    if(messageQueue_.count() > QUEUE_MAX_SIZE)
-                        messageQueue_.dequeue();
-                    messageQueue_.enqueue(msg);
-
-                    buffer_.remove(0, indexOfEnd + 1); // Remove valid message and possible garbage before message
-                    exit = false;
-                } else
-                    buffer_.clear();
-            }
-        }
-    } while(!exit);
+    if(-1 != datagramTimerId_)
+        killTimer(datagramTimerId_);
+    datagramTimerId_ = -1;
+    if(-1 != datagramPacingTimerId_)
+        killTimer(datagramPacingTimerId_);
+    datagramPacingTimerId_ = -1;
+    datagramQueue_.clear();
+    datagramQueueBytes_ = 0;
+    datagramRate_ = 0;
+    datagramTokens_ = DATAGRAM_BURST_SIZE;
+    datagramTokenTime_ = 0;
+    udpSocket_->close();
+    datagramPort_ = 0;
+    datagramFrame_ = 0;
+    datagramSequence_ = 0;
+    hasDatagramFrame_ = false;
+    datagramChunks_.clear();
+    datagramChunksReceived_ = 0;
+    datagramMessage_.payload = QByteArray();
 }
 
-void RemoteWindowSocket::sendJoinSession()
+bool RemoteWindowSocket::dropDatagram() const
 {
-    sendMessage(SC_JOIN_SESSION);
+    return datagramLossRate_ > 0.0 && QRandomGenerator::global()->generateDouble() < datagramLossRate_;
 }
 
-void RemoteWindowSocket::sendJoinSessionAck()
+QByteArray RemoteWindowSocket::frameTiming(qint64 captureTime)
 {
-    sendMessage(SC_JOIN_SESSION_ACK);
+    // Sequence numbers count every frame handed to us, so a gap on the other side means a frame was skipped
+    QByteArray timing(FRAME_TIMING_SIZE, Qt::Uninitialized);
+    uchar *dst = reinterpret_cast<uchar *>(timing.data());
+
+    qToBigEndian<quint32>(++frameSequence_, dst);
+    qToBigEndian<qint64>(captureTime < 0 ? timestamp() : captureTime, dst + 4);
+    return timing;
 }
 
-void RemoteWindowSocket::sendLeaveSession()
+bool RemoteWindowSocket::takeFrameTiming(quint32 &sequence, qint64 &captureTime, int &offset)
 {
-    sendMessage(SC_LEAVE_SESSION);
+    // The payload is left where it is, the frame data simply starts at the offset returned
+    sequence = 0;
+    captureTime = -1;
+    offset = 0;
+    if(!features_.testFlag(SF_FRAME_TIMING))
+        return true;
+    if(message_.payload.size() < FRAME_TIMING_SIZE)
+        return false;
+
+    const uchar *src = reinterpret_cast<const uchar *>(message_.payload.constData());
+    sequence = qFromBigEndian<quint32>(src);
+    captureTime = qFromBigEndian<qint64>(src + 4);
+    offset = FRAME_TIMING_SIZE;
+    return true;
 }
 
-void RemoteWindowSocket::sendMouseEvent(const SocketCommand &command, const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers)
+void RemoteWindowSocket::sendPing()
 {
+    if(SS_JOINED != sessionState_ || !features_.testFlag(SF_FRAME_TIMING))
+        return;
+
     QByteArray data;
     QDataStream stream(&data, QIODevice::WriteOnly);
 
-    stream << static_cast<int>(button) << position << static_cast<int>(modifiers);
-    sendMessage(command, data);
+    stream << timestamp();
+    sendMessage(SC_PING, data);
 }
 
-void RemoteWindowSocket::sendKeyEvent(const SocketCommand &command, const Qt::Key &key, const Qt::KeyboardModifiers &modifiers)
+void RemoteWindowSocket::sendPong(qint64 pingTime)
 {
+    // The time the ping came in, not the time it got processed, so our own queueing doesn't count as network delay
     QByteArray data;
     QDataStream stream(&data, QIODevice::WriteOnly);
 
-    stream << static_cast<int>(key) << static_cast<int>(modifiers);
-    sendMessage(command, data);
+    stream << pingTime << message_.time;
+    sendMessage(SC_PONG, data);
 }
 
-void RemoteWindowSocket::setSessionState(const SessionState &value)
+void RemoteWindowSocket::sendFrameAck(quint32 sequence, qint64 captureTime)
 {
-    if(sessionState_ != value) {
-        sessionState_ = value;
-        emit sessionStateChanged();
+    if(SS_JOINED != sessionState_ || !features_.testFlag(SF_FRAME_TIMING))
+        return;
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    const qint64 now = timestamp();
+
+    // Our side of the same measurement, once the clocks have been lined up
+    if(hasClockOffset_) {
+        const qint64 latency = qMax<qint64>(now - (captureTime - clockOffset_), 0);
+        frameLatency_ = frameLatency_ < 0 ? latency : (frameLatency_ * 3 + latency) / 4;
+        framesAcknowledged_++;
+        emit frameAcknowledged(sequence, latency);
+    }
+
+    stream << sequence << captureTime << now;
+    sendMessage(SC_FRAME_ACK, data);
+}
+
+void RemoteWindowSocket::applyPong(const QByteArray &pong)
+{
+    qint64 pingTime = 0;
+    qint64 peerTime = 0;
+    QDataStream stream(pong);
+
+    stream >> pingTime >> peerTime;
+    if(QDataStream::Ok != stream.status())
+        return;
+
+    const qint64 roundTripTime = message_.time - pingTime;
+    if(roundTripTime < 0)
+        return;
+
+    // The offset is only taken from samples that weren't held up, those give the tightest bound
+    roundTripTime_ = roundTripTime_ < 0 ? roundTripTime : (roundTripTime_ * 7 + roundTripTime) / 8;
+    if(!hasClockOffset_ || roundTripTime <= roundTripTime_) {
+        clockOffset_ = peerTime - (pingTime + roundTripTime / 2);
+        hasClockOffset_ = true;
+    }
+    updateStatus();
+}
+
+void RemoteWindowSocket::applyFrameAck(const QByteArray &ack)
+{
+    quint32 sequence = 0;
+    qint64 captureTime = 0;
+    qint64 displayTime = 0;
+    QDataStream stream(ack);
+
+    stream >> sequence >> captureTime >> displayTime;
+    if(QDataStream::Ok != stream.status())
+        return;
+
+    // When the frame was shown, on our clock
+    qint64 shownTime = message_.time;
+    if(hasClockOffset_)
+        shownTime = qMin(shownTime, displayTime - clockOffset_);
+    else if(roundTripTime_ >= 0)
+        shownTime -= roundTripTime_ / 2;
+
+    const qint64 latency = qMax<qint64>(shownTime - captureTime, 0);
+    frameLatency_ = frameLatency_ < 0 ? latency : (frameLatency_ * 3 + latency) / 4;
+    framesAcknowledged_++;
+
+    // The first frame captured after an input is the earliest that can show its effect. The input left
+    // the peer about half a round trip before it got here.
+    if(inputTime_ >= 0 && captureTime >= inputTime_) {
+        const qint64 inputLatency = shownTime - inputTime_ + qMax<qint64>(roundTripTime_, 0) / 2;
+        inputLatency_ = inputLatency_ < 0 ? inputLatency : (inputLatency_ * 3 + inputLatency) / 4;
+        inputTime_ = -1;
     }
+
+    updateStatus();
+    emit frameAcknowledged(sequence, latency);
+}
+
+void RemoteWindowSocket::resetTiming()
+{
+    if(-1 != pingTimerId_)
+        killTimer(pingTimerId_);
+    pingTimerId_ = -1;
+    frameSequence_ = 0;
+    roundTripTime_ = -1;
+    clockOffset_ = 0;
+    hasClockOffset_ = false;
+    frameLatency_ = -1;
+    inputLatency_ = -1;
+    inputTime_ = -1;
+}
+
+void RemoteWindowSocket::decodeWindowFrame(RemoteWindowDecoder::JobKind kind, int offset, quint32 sequence, qint64 captureTime)
+{
+    // The compositor is only kept up to date when it is needed, plain viewers may decode the image data themselves
+    RemoteWindowDecoder::Job job;
+
+    job.kind = kind;
+    job.codec = message_.codec;
+    job.payload = message_.payload;
+    job.offset = offset;
+    job.decodeImage = features_.testFlag(SF_DELTA_FRAMES)
+        || isSignalConnected(QMetaMethod::fromSignal(&RemoteWindowSocket::windowImageUpdated))
+        || isSignalConnected(QMetaMethod::fromSignal(&RemoteWindowSocket::windowImageReceived));
+    job.sequence = sequence;
+    job.captureTime = captureTime;
+    decoder_->submit(job);
+}
+
+void RemoteWindowSocket::applyWindowShared(const QByteArray &notification, quint32 sequence, qint64 captureTime)
+{
+    // No decode and no copy, the window image points straight into the shared segment
+    QImage image = sharedMemory_.read(notification);
+
+    if(image.isNull())
+        return;
+
+    windowImage_ = image;
+    emit windowImageUpdated(QRegion(windowImage_.rect()));
+    emit windowImageReceived(windowImage_);
+    if(captureTime >= 0)
+        sendFrameAck(sequence, captureTime);
 }
 
 void RemoteWindowSocket::process()
 {
+    const qint64 available = bytesAvailable();
+
     readMessage();
+    bytesReceived_ += static_cast<quint64>(available - bytesAvailable());
 
     bool exit = false;
     while(!exit && state() == QAbstractSocket::ConnectedState) {
         switch(socketState_) {
             case SS_READ_MESSAGE:
-                if(messageQueue_.isEmpty())
+                if(!dequeueMessage())
                     exit = true;
-                else {
-                    message_ = messageQueue_.dequeue();
+                else
                     socketState_ = SS_READ_COMMAND;
-                }
                 break;
             case SS_READ_COMMAND:
                 if(SOCKET_STATE_MAPPING.contains(message_.command))
@@ -261,30 +1843,171 @@ void RemoteWindowSocket::process()
 
             case SS_PROCESS_JOIN_SESSION:
                 if(SS_NO_SESSION == sessionState_) {
+                    quint16 magic = 0;
+                    quint8 version = 0;
+                    quint32 requested = 0;
+                    QList<quint8> codecs;
+                    QDataStream stream(&message_.payload, QIODevice::ReadOnly);
+
+                    stream >> magic >> version;
+                    if(QDataStream::Ok != stream.status() || FRAME_MAGIC != magic)
+                        version = 0; // Legacy peer
+                    version = qMin(version, FRAME_VERSION);
+                    stream >> requested;
+                    if(QDataStream::Ok != stream.status() || 0 == version)
+                        requested = 0;
+                    features_ = SessionFeatures(static_cast<int>(requested)) & SUPPORTED_FEATURES;
+                    if(!peerAddress().isLoopback())
+                        features_.setFlag(SF_SHARED_MEMORY_FRAMES, false); // The peer can't map our memory
+
+                    // Pick the first codec of the peer's preference list that we know about
+                    stream >> codecs;
+                    codec_ = RemoteWindowCodec::CI_JPEG_ZLIB;
+                    if(QDataStream::Ok == stream.status() && version > 0) {
+                        for(quint8 codec : codecs) {
+                            if(nullptr != RemoteWindowCodec::codec(codec)) {
+                                codec_ = codec;
+                                break;
+                            }
+                        }
+                    }
+
+                    // Frames can only go over UDP if we know where to send them
+                    quint16 datagramPort = 0;
+                    stream >> datagramPort;
+                    if(QDataStream::Ok != stream.status() || 0 == datagramPort || !udpSocket_->bind(localAddress(), 0))
+                        features_.setFlag(SF_DATAGRAM_FRAMES, false);
+                    if(features_.testFlag(SF_DATAGRAM_FRAMES)) {
+                        udpSocket_->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, DATAGRAM_BUFFER_SIZE);
+                        datagramPort_ = datagramPort;
+                    } else
+                        udpSocket_->close();
+
+                    // Older peers end the join here, they get full frames at the server's quality
+                    QSize viewportSize;
+                    double preferredQuality = -1.0;
+                    stream >> viewportSize >> preferredQuality;
+                    if(QDataStream::Ok != stream.status()) {
+                        viewportSize = QSize();
+                        preferredQuality = -1.0;
+                    }
+                    if(viewportSize.isEmpty())
+                        features_.setFlag(SF_SCALED_FRAMES, false);
+                    viewportSize_ = features_.testFlag(SF_SCALED_FRAMES) ? viewportSize : QSize();
+                    preferredQuality_ = preferredQuality < 0.0 ? -1.0 : qMin(preferredQuality, 1.0);
+
+                    // The ack still goes out in the legacy format, the peer switches once it has seen it
                     setSessionState(SS_JOINED);
-                    sendJoinSessionAck();
+                    sendJoinSessionAck(version, features_, codec_);
+                    if(version > 0)
+                        wireFormat_ = WF_BINARY;
                 }
                 // @Todo: nack
                 socketState_ = SS_READ_COMMAND_DONE;
                 break;
             case SS_PROCESS_JOIN_SESSION_ACK:
-                if(SS_JOINING == sessionState_)
+                if(SS_JOINING == sessionState_) {
+                    quint16 magic = 0;
+                    quint8 version = 0;
+                    quint32 agreed = 0;
+                    quint8 codec = RemoteWindowCodec::CI_JPEG_ZLIB;
+                    QDataStream stream(&message_.payload, QIODevice::ReadOnly);
+
+                    stream >> magic >> version;
+                    if(QDataStream::Ok == stream.status() && FRAME_MAGIC == magic && version > 0 && version <= FRAME_VERSION) {
+                        wireFormat_ = WF_BINARY;
+                        stream >> agreed >> codec;
+                        if(QDataStream::Ok == stream.status() && nullptr != RemoteWindowCodec::codec(codec)) {
+                            features_ = SessionFeatures(static_cast<int>(agreed)) & requestedFeatures_;
+                            codec_ = codec;
+                        }
+                    }
+                    if(!features_.testFlag(SF_DATAGRAM_FRAMES))
+                        udpSocket_->close();
                     setSessionState(SS_JOINED);
+                }
                 socketState_ = SS_READ_COMMAND_DONE;
                 break;
             case SS_PROCESS_LEAVE_SESSION:
                 setSessionState(SS_NO_SESSION);
                 socketState_ = SS_READ_COMMAND_DONE;
                 break;
-            case SS_PROCESS_WINDOW_CAPTURE:
-                emit windowCaptureReceived(qUncompress(message_.payload));
+            case SS_PROCESS_WINDOW_CAPTURE: {
+                quint32 sequence;
+                qint64 captureTime;
+                int offset;
+
+                if(takeFrameTiming(sequence, captureTime, offset))
+                    decodeWindowFrame(RemoteWindowDecoder::JK_IMAGE, offset, sequence, captureTime);
+                lastFrameTime_ = clock_.elapsed();
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
+            }
+            case SS_PROCESS_WINDOW_DELTA: {
+                quint32 sequence;
+                qint64 captureTime;
+                int offset;
+
+                if(takeFrameTiming(sequence, captureTime, offset) && features_.testFlag(SF_DELTA_FRAMES))
+                    decodeWindowFrame(RemoteWindowDecoder::JK_DELTA_TILES, offset, sequence, captureTime);
+                lastFrameTime_ = clock_.elapsed();
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
+            }
+            case SS_PROCESS_WINDOW_TILES: {
+                quint32 sequence;
+                qint64 captureTime;
+                int offset;
+
+                if(takeFrameTiming(sequence, captureTime, offset) && (features_ & (SF_DELTA_FRAMES | SF_TILED_FRAMES)))
+                    decodeWindowFrame(RemoteWindowDecoder::JK_KEY_TILES, offset, sequence, captureTime);
+                lastFrameTime_ = clock_.elapsed();
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
+            }
+            case SS_PROCESS_WINDOW_SHARED: {
+                quint32 sequence;
+                qint64 captureTime;
+                int offset;
+
+                if(takeFrameTiming(sequence, captureTime, offset) && features_.testFlag(SF_SHARED_MEMORY_FRAMES))
+                    applyWindowShared(QByteArray::fromRawData(message_.payload.constData() + offset, message_.payload.size() - offset), sequence, captureTime);
+                lastFrameTime_ = clock_.elapsed();
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
+            }
+            case SS_PROCESS_PING: {
+                qint64 pingTime = 0;
+                QDataStream stream(message_.payload);
+
+                stream >> pingTime;
+                if(QDataStream::Ok == stream.status() && SS_JOINED == sessionState_)
+                    sendPong(pingTime);
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
+            }
+            case SS_PROCESS_PONG:
+                applyPong(message_.payload);
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
+            case SS_PROCESS_FRAME_ACK:
+                applyFrameAck(message_.payload);
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
+            case SS_PROCESS_KEY_FRAME_REQUEST:
+                emit keyFrameRequestReceived();
                 socketState_ = SS_READ_COMMAND_DONE;
                 break;
             case SS_PROCESS_MOUSE_MOVE: {
                 QPoint position;
                 QDataStream stream(&message_.payload, QIODevice::ReadOnly);
                 stream >> position;
-                emit mouseMoveReceived(position);
+
+                // Peers that don't batch still flood us with moves, only replay the latest one
+                if(!messageQueue_.isEmpty() && SC_MOUSE_MOVE == messageQueue_.head().command)
+                    coalescedMoveCount_++;
+                else
+                    emit mouseMoveReceived(position);
                 socketState_ = SS_READ_COMMAND_DONE;
                 break;
             }
@@ -320,6 +2043,10 @@ void RemoteWindowSocket::process()
                 socketState_ = SS_READ_COMMAND_DONE;
                 break;
             }
+            case SS_PROCESS_INPUT_BATCH:
+                applyInputBatch(message_.payload);
+                socketState_ = SS_READ_COMMAND_DONE;
+                break;
             case SS_PROCESS_CHAT_MESSAGE: {
                 QString msg;
                 QDataStream stream(&message_.payload, QIODevice::ReadOnly);
@@ -331,6 +2058,14 @@ void RemoteWindowSocket::process()
             }
         }
     }
+    updateStatus();
+}
+
+void RemoteWindowSocket::onReadyRead()
+{
+    // With a read rate the timer does the reading, a bit at a time
+    if(0 == readRate_)
+        process();
 }
 
 void RemoteWindowSocket::onStateChanged(const QAbstractSocket::SocketState &state)
@@ -341,8 +2076,86 @@ void RemoteWindowSocket::onStateChanged(const QAbstractSocket::SocketState &stat
         case ClosingState:
         case UnconnectedState:
             // Session lost...
-            buffer_.clear();
+            resetParser();
+            resetPendingFrame();
+            pendingDeltas_.clear();
+            resetInputBatch();
+            hasOutgoing_ = false;
+            outgoingProtected_ = false;
+            outgoing_.payload = QByteArray();
+            drainStart_ = -1;
+            lastFrameTime_ = -1;
+            wireFormat_ = WF_LEGACY;
+            features_ = SF_NONE;
+            codec_ = RemoteWindowCodec::CI_JPEG_ZLIB;
+            decoder_->reset();
+            windowImage_ = QImage();
+            sharedMemory_.release();
+            resetDatagrams();
+            resetTiming();
+            frameQueue_.clear();
+            awaitingKeyFrame_ = false;
             setSessionState(SS_NO_SESSION);
+            updateStatus();
             break;
     }
 }
+
+void RemoteWindowSocket::onBytesWritten(qint64 bytes)
+{
+    bytesSent_ += static_cast<quint64>(bytes);
+    if(drainStart_ >= 0 && 0 == bytesToWrite() && !hasOutgoing_) {
+        drainTime_ = clock_.elapsed() - drainStart_;
+        if(drainTime_ > 0) {
+            qint64 throughput = drainBytes_ * 1000 / drainTime_;
+            throughput_ = throughput_ > 0 ? (throughput_ * 3 + throughput) / 4 : throughput;
+        }
+        drainStart_ = -1;
+    }
+    updateStatus();
+
+    if(features_.testFlag(SF_CHUNKED_FRAMES)) {
+        pumpFragments();
+        return;
+    }
+    Message frame;
+    while(bytesToWrite() <= writeBufferThreshold_ && takePendingFrame(frame))
+        writeWindowFrame(frame);
+}
+
+void RemoteWindowSocket::onDatagramsReady()
+{
+    while(udpSocket_->hasPendingDatagrams()) {
+        const qint64 size = udpSocket_->pendingDatagramSize();
+        QByteArray datagram(static_cast<int>(qMax<qint64>(size, 0)), Qt::Uninitialized);
+        QHostAddress sender;
+
+        if(udpSocket_->readDatagram(datagram.data(), datagram.size(), &sender) < DATAGRAM_HEADER_SIZE)
+            continue;
+        if(!sender.isEqual(peerAddress(), QHostAddress::ConvertV4MappedToIPv4) || dropDatagram())
+            continue;
+        bytesReceived_ += static_cast<quint64>(datagram.size());
+        receiveDatagram(datagram);
+    }
+
+    process();
+}
+
+void RemoteWindowSocket::onDecoderFrameDecoded(const RemoteWindowDecoder::Frame &frame)
+{
+    // Decoded before the session was lost
+    if(SS_JOINED != sessionState_)
+        return;
+
+    if(!frame.image.isNull()) {
+        windowImage_ = frame.image;
+        emit windowImageUpdated(frame.region);
+        emit windowImageReceived(windowImage_);
+    }
+    if(!frame.imageData.isEmpty())
+        emit windowCaptureReceived(frame.imageData);
+
+    // Viewers paint from these signals, so by now the frame is as good as shown
+    if(frame.captureTime >= 0)
+        sendFrameAck(frame.sequence, frame.captureTime);
+}
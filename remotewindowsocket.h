@@ -1,9 +1,19 @@
 #pragma once
 
+#include "remotewindowcodec.h"
+#include "remotewindowdecoder.h"
+#include "remotewindowsharedmemory.h"
 #include <QTcpSocket>
+#include <QHostAddress>
+#include <QMutex>
 #include <QMap>
 #include <QQueue>
+#include <QVector>
+#include <QImage>
+#include <QRegion>
+#include <QElapsedTimer>
 
+class QUdpSocket;
 class RemoteWindowSocket : public QTcpSocket
 {
     Q_OBJECT
@@ -17,13 +27,136 @@ public:
         SS_JOINED,
     };
 
+    enum SessionFeature
+    {
+        SF_NONE         = 0x00,
+        SF_DELTA_FRAMES = 0x01,
+        SF_INPUT_BATCHES = 0x02,
+        SF_CHUNKED_FRAMES = 0x04,
+        SF_SHARED_MEMORY_FRAMES = 0x08, // Same host only, raw frames are passed through shared memory
+        SF_DATAGRAM_FRAMES = 0x10, // Frames go over UDP, a lost frame is never retransmitted
+        SF_FRAME_TIMING = 0x20, // Frames carry a sequence number and capture time, the peer pings and acknowledges them
+        SF_SCALED_FRAMES = 0x40, // Frames are scaled down to the viewport of the peer, input positions are in frame pixels
+        SF_TILED_FRAMES = 0x80, // Key frames come as independent bands, encoded and decoded in parallel, even without deltas
+    };
+    Q_DECLARE_FLAGS(SessionFeatures, SessionFeature)
+
+    enum MessageClass
+    {
+        MC_CONTROL,
+        MC_INPUT,
+        MC_FRAME,
+    };
+
+    struct QueueCounters
+    {
+        quint64 messages;
+        quint64 dropped;
+        qint64 totalDelay; // In us
+        qint64 maxDelay; // In us
+    };
+
+    struct Status
+    {
+        SessionState sessionState;
+        SessionFeatures features;
+        quint8 codec;
+        QHostAddress peerAddress;
+        qint64 bytesToWrite;
+        qint64 drainTime;
+        qint64 throughput;
+        bool frameBacklog; // A frame is still waiting or going out, a delta encoded now would only queue behind it
+        qint64 roundTripTime; // In us, negative until measured
+        qint64 frameLatency; // In us, from capture until the peer showed the frame
+        qint64 inputLatency; // In us, from input leaving the peer until the first frame captured after it was shown
+        QSize viewportSize; // The peer's, invalid if it didn't ask for scaled frames
+        double preferredQuality; // The peer's, negative if it has no preference
+    };
+
+    struct Metrics
+    {
+        quint64 bytesReceived;
+        quint64 bytesSent;
+        quint64 messagesReceived;
+        quint64 messagesSent;
+        quint64 framesReceived;
+        quint64 framesSent;
+        quint64 framesSkipped; // Not sent, the peer couldn't keep up
+        quint64 framesDropped; // Received, but superseded before they were processed
+        quint64 decodesSkipped;
+        quint64 resyncs;
+        quint64 discardedBytes;
+        qint64 writeBufferHighWater; // In bytes
+        quint64 framesAcknowledged;
+        qint64 roundTripTime; // In us
+        qint64 frameLatency; // In us
+        qint64 inputLatency; // In us
+    };
+
     RemoteWindowSocket(QObject *parent = nullptr);
     RemoteWindowSocket(qintptr handle, QObject *parent = nullptr);
     virtual ~RemoteWindowSocket() override;
 
     SessionState sessionState() const;
+    Status status() const;
+    Metrics metrics() const;
+    quint64 resyncCount() const;
+    quint64 discardedByteCount() const;
+    quint64 skippedFrameCount() const;
+    QueueCounters receiveCounters(MessageClass messageClass) const;
+    QueueCounters sendCounters(MessageClass messageClass) const;
+    qint64 drainTime() const;
+    qint64 throughput() const;
+    qint64 frameAge() const;
+
+    qint64 writeBufferThreshold() const;
+    void setWriteBufferThreshold(qint64 value);
+
+    int inputBatchDelay() const;
+    void setInputBatchDelay(int value);
+    quint64 coalescedMoveCount() const;
+    quint64 skippedDecodeCount() const;
+
+    // Caps how fast the socket takes data in, to make a viewer as slow as some real network would. 0 is no limit.
+    qint64 readRate() const;
+    void setReadRate(qint64 value); // In bytes per second
+
+    // Drops this fraction of the datagrams sent and received, to try out loss recovery over loopback
+    double datagramLossRate() const;
+    void setDatagramLossRate(double value);
+    quint64 lostDatagramCount() const;
+
+    // Datagrams of a frame are paced out over this long instead of in one burst, which would overflow the
+    // send buffer and the queues along the path. 0 sends them as fast as the socket takes them. Thread safe.
+    int datagramPacing() const;
+    void setDatagramPacing(int value); // In ms
+
+    SessionFeatures requestedFeatures() const;
+    void setRequestedFeatures(SessionFeatures value);
+    SessionFeatures features() const;
+
+    QList<quint8> preferredCodecs() const;
+    void setPreferredCodecs(const QList<quint8> &value);
+    quint8 codec() const;
+
+    // Sent along when joining, so the server can scale frames down and pick a quality for this viewer.
+    // Scaling needs SF_SCALED_FRAMES, which is requested by default but only used with a valid viewport size.
+    QSize viewportSize() const;
+    void setViewportSize(const QSize &value);
+    double preferredQuality() const;
+    void setPreferredQuality(double value); // Between 0.0 and 1.0, negative leaves it up to the server
+
+    // With shared memory frames the image is backed by the sender's ring buffer and only valid until the
+    // next frame is received or the session ends, copy it to keep it around
+    QImage windowImage() const;
 
-    void sendWindowCapture(const QByteArray &compressed);
+    // The frame senders, setWriteBufferThreshold(), status() and metrics() may be called from any thread,
+    // the rest only from the thread the socket lives in.
+    void sendWindowCapture(const QByteArray &encoded, qint64 captureTime = -1);
+    void sendWindowDelta(const QByteArray &delta, qint64 captureTime = -1);
+    void sendWindowTiles(const QByteArray &tiles, qint64 captureTime = -1);
+    void sendWindowShared(const QByteArray &notification, qint64 captureTime = -1);
+    void sendKeyFrameRequest();
     void sendMouseMove(const QPoint &position);
     void sendMousePress(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers = Qt::KeyboardModifier());
     void sendMouseRelease(const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers = Qt::KeyboardModifier());
@@ -32,6 +165,11 @@ public:
     void sendKeyRelease(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers = Qt::KeyboardModifiers());
     void sendChatMessage(QString msg);
 
+    static void broadcastChatMessage(const QList<RemoteWindowSocket *> &sockets, QString msg);
+
+    // In us, monotonic and shared by every socket in the process. Capture times are taken from this clock.
+    static qint64 timestamp();
+
 private:
     enum SocketState
     {
@@ -50,6 +188,36 @@ private:
         SS_PROCESS_KEY_PRESS,
         SS_PROCESS_KEY_RELEASE,
         SS_PROCESS_CHAT_MESSAGE,
+        SS_PROCESS_WINDOW_DELTA,
+        SS_PROCESS_KEY_FRAME_REQUEST,
+        SS_PROCESS_WINDOW_TILES,
+        SS_PROCESS_INPUT_BATCH,
+        SS_PROCESS_WINDOW_SHARED,
+        SS_PROCESS_PING,
+        SS_PROCESS_PONG,
+        SS_PROCESS_FRAME_ACK,
+    };
+
+    enum ParserState
+    {
+        PS_READ_FRAME_START,
+        PS_READ_BINARY_HEADER,
+        PS_READ_LEGACY_HEADER,
+        PS_READ_PAYLOAD,
+        PS_READ_LEGACY_END,
+    };
+
+    enum FrameFlag
+    {
+        FF_NONE             = 0x00,
+        FF_FRAGMENT         = 0x01,
+        FF_LAST_FRAGMENT    = 0x02,
+    };
+
+    enum WireFormat
+    {
+        WF_LEGACY,
+        WF_BINARY,
     };
 
     enum SocketCommand
@@ -66,39 +234,237 @@ private:
         SC_KEY_PRESS,
         SC_KEY_RELEASE,
         SC_CHAT_MESSAGE,
+        SC_WINDOW_DELTA,
+        SC_KEY_FRAME_REQUEST,
+        SC_WINDOW_TILES,
+        SC_INPUT_BATCH,
+        SC_WINDOW_SHARED,
+        SC_PING,
+        SC_PONG,
+        SC_FRAME_ACK,
     };
 
     struct Message
     {
         SocketCommand command;
+        quint8 codec;
+        QByteArray prefix; // Written in front of the payload, per socket, while the payload is shared
         QByteArray payload;
+        qint64 time; // In us, when it was queued
+    };
+
+    struct InputEvent
+    {
+        SocketCommand command;
+        int code; // Mouse button or key
+        QPoint position;
+        int modifiers;
+    };
+
+    struct FrameHeader
+    {
+        quint16 magic;
+        quint8 version;
+        quint8 command;
+        quint8 flags;
+        quint8 codec;
+        quint16 stream; // Fragments only
+        quint32 payloadSize;
+    };
+
+    struct DatagramHeader
+    {
+        quint16 magic;
+        quint8 command;
+        quint8 codec;
+        quint32 sequence; // Per datagram, only used to count losses
+        quint32 frame;
+        quint16 index;
+        quint16 count;
     };
 
     static const QMap<SocketCommand, SocketState> SOCKET_STATE_MAPPING;
-    static const int BUFFER_MAX_SIZE;
+    static const int PAYLOAD_MAX_SIZE;
+    static const int LEGACY_HEADER_MAX_SIZE;
+    static const qint64 WRITE_BUFFER_THRESHOLD_DEFAULT;
     static const int QUEUE_MAX_SIZE;
+    static const int PENDING_DELTAS_MAX_SIZE;
     static const int CHAT_MSG_MAX_SIZE;
+    static const int INPUT_BATCH_MAX_SIZE;
+    static const int FRAGMENT_SIZE;
+    static const int DATAGRAM_HEADER_SIZE;
+    static const int DATAGRAM_PAYLOAD_SIZE;
+    static const int DATAGRAM_BUFFER_SIZE;
+    static const int DATAGRAM_REASSEMBLY_TIMEOUT;
+    static const int DATAGRAM_PACING_INTERVAL;
+    static const int DATAGRAM_BURST_SIZE;
+    static const qint64 DATAGRAM_RATE_MIN;
+    static const int FRAME_TIMING_SIZE;
+    static const int PING_INTERVAL;
+    static const int READ_INTERVAL;
     static const char MESSAGE_START_MARKER;
     static const char MESSAGE_END_MARKER;
     static const char MESSAGE_PAYLOAD_SIZE_MARKER;
     static const char MESSAGE_PAYLOAD_MARKER;
+    static const quint16 FRAME_MAGIC;
+    static const quint8 FRAME_VERSION;
+    static const int FRAME_HEADER_SIZE;
+    static const SessionFeatures SUPPORTED_FEATURES;
 
-    bool sendMessage(const SocketCommand &command, const QByteArray &data = QByteArray());
+    static void writeFrameHeader(char *dst, const FrameHeader &header);
+    static FrameHeader readFrameHeader(const char *src);
+    static void writeDatagramHeader(char *dst, const DatagramHeader &header);
+    static DatagramHeader readDatagramHeader(const char *src);
+    static QByteArray chatMessagePayload(QString msg);
+    static MessageClass messageClass(const SocketCommand &command);
+
+    bool sendMessage(const SocketCommand &command, const QByteArray &data = QByteArray(), quint8 codec = RemoteWindowCodec::CI_JPEG_ZLIB);
+    bool sendLegacyMessage(const SocketCommand &command, const QByteArray &prefix, const QByteArray &data);
+    bool sendBinaryMessage(const SocketCommand &command, const QByteArray &prefix, const QByteArray &data, quint8 codec);
+    bool sendWindowFrameMessage(const Message &frame);
+    static int messageSize(const Message &message);
+    static void copyMessageData(char *dst, const Message &message, int offset, int size);
+    bool sendFragment(const Message &frame, int offset, int size, bool last);
     void readMessage();
+    void beginPayload(const SocketCommand &command, quint8 codec, int size, bool legacy);
+    void beginFragment(const FrameHeader &header);
+    void finishPayload();
+    void discardByte();
+    void resetParser();
+    void enqueueMessage(Message msg);
+    bool dequeueMessage();
+    void countSentMessage(MessageClass messageClass, qint64 queueTime);
 
     void sendJoinSession();
-    void sendJoinSessionAck();
+    void sendJoinSessionAck(quint8 version, SessionFeatures features, quint8 codec);
     void sendLeaveSession();
     void sendMouseEvent(const SocketCommand &command, const Qt::MouseButton &button, const QPoint &position, const Qt::KeyboardModifiers &modifiers);
     void sendKeyEvent(const SocketCommand &command, const Qt::Key &key, const Qt::KeyboardModifiers &modifiers);
+    void queueInputEvent(const InputEvent &event);
+    void flushInputBatch();
+    void resetInputBatch();
+    void applyInputBatch(const QByteArray &batch);
+    void emitInputEvent(const InputEvent &event);
+
+    virtual void timerEvent(QTimerEvent *event) override;
 
     void setSessionState(const SessionState &value);
+    void updateStatus();
+    void sendWindowFrame(const SocketCommand &command, const QByteArray &data, qint64 captureTime);
+    QByteArray frameTiming(qint64 captureTime);
+    bool takeFrameTiming(quint32 &sequence, qint64 &captureTime, int &offset);
+    void sendPing();
+    void sendPong(qint64 pingTime);
+    void sendFrameAck(quint32 sequence, qint64 captureTime);
+    void applyPong(const QByteArray &pong);
+    void applyFrameAck(const QByteArray &ack);
+    void resetTiming();
+    void sendFragmentedWindowFrame(const Message &frame);
+    void writeWindowFrame(const Message &frame);
+    void pumpFragments();
+    void resetPendingFrame();
+    void queueDelta(const Message &frame);
+    void dropPendingDeltas();
+    bool takePendingFrame(Message &frame);
+    void sendDatagramFrame(const Message &frame);
+    void receiveDatagram(const QByteArray &datagram);
+    void datagramFrameLost();
+    void resetDatagrams();
+    void pumpDatagrams();
+    bool dropDatagram() const;
+    void decodeWindowFrame(RemoteWindowDecoder::JobKind kind, int offset, quint32 sequence, qint64 captureTime);
+    void applyWindowShared(const QByteArray &notification, quint32 sequence, qint64 captureTime);
 
-    QQueue<Message> messageQueue_;
+    QQueue<Message> messageQueue_; // Control and input, in the order they arrived
+    QQueue<Message> frameQueue_;
+    bool awaitingKeyFrame_;
+    QueueCounters receiveCounters_[MC_FRAME + 1];
+    QueueCounters sendCounters_[MC_FRAME + 1];
     SocketState socketState_;
     SessionState sessionState_;
+    WireFormat wireFormat_;
+    SessionFeatures requestedFeatures_;
+    SessionFeatures features_;
+    QList<quint8> preferredCodecs_;
+    QSize viewportSize_; // On the server end the viewer's
+    double preferredQuality_; // On the server end the viewer's
+    quint8 codec_;
+    QImage windowImage_;
+    RemoteWindowSharedMemory sharedMemory_;
+    RemoteWindowDecoder *decoder_;
     Message message_;
-    QByteArray buffer_;
+    ParserState parserState_;
+    Message pending_;
+    bool pendingLegacy_;
+    bool pendingFragment_;
+    bool pendingLastFragment_;
+    Message fragments_;
+    quint16 fragmentStream_;
+    bool hasFragments_;
+    int payloadRead_;
+    bool resyncing_;
+    quint64 resyncCount_;
+    quint64 discardedByteCount_;
+    qint64 writeBufferThreshold_;
+    Message pendingFrame_;
+    bool hasPendingFrame_;
+    QQueue<Message> pendingDeltas_; // Behind the pending or outgoing frame, they build on it
+    bool deltaChainBroken_;
+    Message outgoing_;
+    int outgoingOffset_;
+    quint16 outgoingStream_;
+    quint16 nextStream_;
+    bool hasOutgoing_;
+    bool outgoingProtected_;
+    QElapsedTimer clock_;
+    qint64 drainStart_;
+    qint64 drainBytes_;
+    qint64 drainTime_;
+    qint64 throughput_;
+    qint64 lastFrameTime_;
+    QList<InputEvent> inputBatch_;
+    int inputBatchDelay_;
+    int inputBatchTimerId_;
+    int inputBatchTimerDelay_;
+    quint64 coalescedMoveCount_;
+    QUdpSocket *udpSocket_;
+    quint16 datagramPort_; // The peer's, only known to the sending side
+    quint32 nextDatagramFrame_;
+    quint32 nextDatagramSequence_;
+    quint32 datagramFrame_;
+    quint32 datagramSequence_;
+    bool hasDatagramFrame_;
+    Message datagramMessage_;
+    QVector<QByteArray> datagramChunks_;
+    int datagramChunksReceived_;
+    int datagramTimerId_; // Gives up on an incomplete frame, no newer one may come on a static window
+    QQueue<QByteArray> datagramQueue_;
+    qint64 datagramQueueBytes_;
+    int datagramPacing_;
+    qint64 datagramRate_; // In bytes per second, 0 is unpaced
+    qint64 datagramTokens_; // In bytes
+    qint64 datagramTokenTime_; // In us
+    int datagramPacingTimerId_;
+    double datagramLossRate_;
+    quint64 lostDatagramCount_;
+    quint64 bytesReceived_;
+    quint64 bytesSent_;
+    qint64 writeBufferHighWater_;
+    quint32 frameSequence_;
+    int pingTimerId_;
+    qint64 roundTripTime_;
+    qint64 clockOffset_; // The peer's clock minus ours, in us
+    bool hasClockOffset_;
+    qint64 frameLatency_;
+    qint64 inputLatency_;
+    qint64 inputTime_; // When the oldest input not yet answered by a frame came in
+    quint64 framesAcknowledged_;
+    qint64 readRate_;
+    int readTimerId_;
+    mutable QMutex statusMutex_;
+    Status status_;
+    Metrics metrics_;
+    qint64 statusDrainStart_;
 
 signals:
     void windowCaptureReceived(const QByteArray &data);
@@ -109,9 +475,22 @@ signals:
     void keyPressReceived(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers);
     void keyReleaseReceived(const Qt::Key &key, const Qt::KeyboardModifiers &modifiers);
     void chatMessageReceived(const QString &msg);
+    void windowImageUpdated(const QRegion &region);
+    // Ready to paint, decoded off the socket's thread. With shared memory frames the pixels are only valid
+    // until the next frame is received or the session ends, copy the image to keep it longer.
+    void windowImageReceived(const QImage &image);
+    void keyFrameRequestReceived();
+    void frameAcknowledged(quint32 sequence, qint64 latency); // On both ends, latency in us from capture until shown
+    void keyFrameRequired();
     void sessionStateChanged();
 
 private slots:
     void process();
+    void onReadyRead();
     void onStateChanged(const QAbstractSocket::SocketState &state);
+    void onBytesWritten(qint64 bytes);
+    void onDatagramsReady();
+    void onDecoderFrameDecoded(const RemoteWindowDecoder::Frame &frame);
 };
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(RemoteWindowSocket::SessionFeatures)
@@ -0,0 +1,21 @@
+QT += gui testlib network concurrent
+
+TEMPLATE = app
+TARGET = tst_remotewindowbenchmark
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# Links against the library built from the repository root, qt-remote-window.pro builds it first
+INCLUDEPATH += $$PWD/../..
+LIBS += -L$$OUT_PWD/../.. -lqt-remote-window-lib
+PRE_TARGETDEPS += $$OUT_PWD/../../libqt-remote-window-lib.a
+
+SOURCES += \
+    tst_remotewindowbenchmark.cpp
+
+# "make benchmark" writes every result as CSV and as XML, to keep around and compare runs by
+benchmark.commands = ./$(TARGET) -o benchmark.csv,csv -o benchmark.xml,xml
+benchmark.depends = $(TARGET)
+QMAKE_EXTRA_TARGETS += benchmark
@@ -0,0 +1,535 @@
+#include "remotewindowcodec.h"
+#include "remotewindowserver.h"
+#include "remotewindowsocket.h"
+#include <QtTest>
+#include <QGuiApplication>
+#include <QPainter>
+#include <QPixmap>
+#include <QTcpServer>
+#include <QWindow>
+#include <algorithm>
+
+// Benchmarks of the hot paths: message framing, capturing and encoding a frame, the codecs on their own
+// and whole sessions over loopback. Runs without a display, the server grabs through a screen shot
+// function that hands out synthetic frames. "make benchmark" writes the results as CSV and XML.
+
+namespace
+{
+
+const int MESSAGE_BATCH_SIZE = 64;
+const int WAIT_TIMEOUT = 10000; // In ms
+const int WINDOW_UPDATE_DURATION = 2000; // In ms
+const int LOOPBACK_DURATION = 2000; // In ms
+const int WINDOW_UPDATE_DELAY = 16; // In ms, about 60 frames per second
+const QSize LOOPBACK_SIZE(1280, 720);
+const QSize SCALING_SIZE(1920, 1080);
+const QSize CODEC_SIZE(1920, 1080);
+const double QUALITY_DEFAULT = 0.3; // The server's default
+const int SYNTHETIC_FRAME_COUNT = 8;
+
+// Accepts a single connection as a plain socket, so both ends of a session are ours to drive
+class LoopbackServer : public QTcpServer
+{
+public:
+    LoopbackServer() :
+        socket(nullptr)
+    {
+
+    }
+
+    RemoteWindowSocket *socket;
+
+protected:
+    virtual void incomingConnection(qintptr handle) override
+    {
+        socket = new RemoteWindowSocket(handle, this);
+    }
+};
+
+// Flat panels, borders and rows of glyph sized marks, roughly what a desktop application shows. The
+// frame number moves the selection and shifts the text, so consecutive frames differ a little.
+QImage uiImage(const QSize &size, int frame)
+{
+    QImage image(size, QImage::Format_RGB32);
+    QPainter painter(&image);
+    const int sidebarWidth = size.width() / 5;
+    const int rowHeight = 22;
+
+    image.fill(QColor(240, 240, 240));
+    painter.fillRect(0, 0, size.width(), 28, QColor(45, 45, 48));
+    painter.fillRect(0, 28, sidebarWidth, size.height() - 28, QColor(225, 228, 232));
+    painter.setPen(QColor(200, 200, 200));
+    painter.drawLine(sidebarWidth, 28, sidebarWidth, size.height());
+
+    const int rows = (size.height() - 40) / rowHeight;
+    for(int row = 0; row < rows; ++row) {
+        const int y = 40 + row * rowHeight;
+
+        if(row == frame % rows)
+            painter.fillRect(sidebarWidth + 1, y - 4, size.width() - sidebarWidth - 1, rowHeight, QColor(0, 120, 215));
+
+        // Words of pseudo random length, the same for a row in every frame except for the shift
+        quint32 seed = static_cast<quint32>(row * 2654435761u);
+        for(int x = sidebarWidth + 12 + (frame + row) % 4; x < size.width() - 60;) {
+            seed = seed * 1103515245u + 12345u;
+            const int width = 8 + static_cast<int>((seed >> 16) % 48);
+            painter.fillRect(x, y + 2, width, 10, row == frame % rows ? QColor(Qt::white) : QColor(30, 30, 30));
+            x += width + 6;
+        }
+        if(row < rows / 2)
+            painter.fillRect(12, y + 2, sidebarWidth / 2 + row % 5 * 6, 10, QColor(60, 60, 60));
+    }
+
+    // Something that isn't flat, a panel with a gradient in a corner
+    QLinearGradient gradient(0, 0, 0, size.height() / 4);
+    gradient.setColorAt(0.0, QColor(120, 170, 220));
+    gradient.setColorAt(1.0, QColor(250, 250, 255));
+    painter.fillRect(QRect(size.width() * 3 / 4, size.height() * 3 / 4, size.width() / 4 - 8, size.height() / 4 - 8), gradient);
+    return image;
+}
+
+QList<QPixmap> syntheticFrames(const QSize &size)
+{
+    QList<QPixmap> frames;
+
+    for(int i = 0; i < SYNTHETIC_FRAME_COUNT; ++i)
+        frames.append(QPixmap::fromImage(uiImage(size, i)));
+    return frames;
+}
+
+qint64 percentile(QVector<qint64> samples, double p)
+{
+    if(samples.isEmpty())
+        return -1;
+
+    const int index = qMin(samples.count() - 1, static_cast<int>(p * samples.count()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples.at(index);
+}
+
+// Resident set size of this process in bytes, -1 if it can't be read. Linux only.
+qint64 residentMemory()
+{
+    QFile file("/proc/self/status");
+
+    if(!file.open(QIODevice::ReadOnly))
+        return -1;
+
+    for(const QByteArray &line : file.readAll().split('\n')) {
+        if(line.startsWith("VmRSS:"))
+            return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024; // In kB
+    }
+    return -1;
+}
+
+bool waitForJoined(const QList<RemoteWindowSocket *> &sockets)
+{
+    return QTest::qWaitFor([&sockets]() {
+        for(RemoteWindowSocket *socket : sockets) {
+            if(RemoteWindowSocket::SS_JOINED != socket->sessionState())
+                return false;
+        }
+        return true;
+    }, WAIT_TIMEOUT);
+}
+
+// A viewer that paints asks for what a real one would and decodes every frame. One that doesn't only
+// takes the frames in and acknowledges them, which keeps the cost of many of them in one process down.
+RemoteWindowSocket *createViewer(QObject *parent, bool painting = true)
+{
+    RemoteWindowSocket *socket = new RemoteWindowSocket(parent);
+
+    if(painting)
+        QObject::connect(socket, &RemoteWindowSocket::windowImageReceived, [](const QImage &) {});
+    return socket;
+}
+
+}
+
+class RemoteWindowBenchmark : public QObject
+{
+    Q_OBJECT
+
+private:
+    struct LoopbackResult
+    {
+        double frameRate; // Per viewer
+        qint64 latency; // In us, median from capture until shown
+        qint64 memory; // In bytes, what the process grew by over the run
+        double throughput; // In bytes per second, received by all viewers together
+    };
+
+    bool runWindowUpdates(const QSize &size, double quality, int encoderThreadCount, RemoteWindowServer::Metrics &metrics);
+    bool runLoopback(int clientCount, bool painting, LoopbackResult &result);
+    bool loopbackResult(int clientCount, bool painting, LoopbackResult &result);
+
+    QHash<QPair<int, bool>, LoopbackResult> loopbackResults_;
+
+private slots:
+    void messageThroughput_data();
+    void messageThroughput();
+    void windowUpdate_data();
+    void windowUpdate();
+    void encoderScaling_data();
+    void encoderScaling();
+    void loopbackFrameRate_data();
+    void loopbackFrameRate();
+    void loopbackLatency_data();
+    void loopbackLatency();
+    void fanOutMemory_data();
+    void fanOutMemory();
+    void fanOutThroughput_data();
+    void fanOutThroughput();
+    void codecEncode_data();
+    void codecEncode();
+    void codecDecode_data();
+    void codecDecode();
+    void codecSize_data();
+    void codecSize();
+};
+
+bool RemoteWindowBenchmark::runWindowUpdates(const QSize &size, double quality, int encoderThreadCount, RemoteWindowServer::Metrics &metrics)
+{
+    // One viewer, so every capture is encoded. The frames change every time, nothing is skipped as unchanged.
+    QWindow window;
+    RemoteWindowServer server(&window, nullptr, 0);
+    const QList<QPixmap> frames = syntheticFrames(size);
+    int nextFrame = 0;
+
+    window.resize(size);
+    server.setScreenShotFunction([&frames, &nextFrame](QWindow *) { return frames.at(nextFrame++ % frames.count()); });
+    server.setWindowUpdateDelay(WINDOW_UPDATE_DELAY);
+    server.setEncoderThreadCount(encoderThreadCount);
+    server.setAdaptive(false); // The rate controller would pick a quality of its own
+    server.setQuality(quality);
+    if(!server.start())
+        return false;
+
+    QObject viewers;
+    RemoteWindowSocket *viewer = createViewer(&viewers);
+
+    viewer->connectToHost(QHostAddress::LocalHost, server.serverPort());
+    if(!waitForJoined(QList<RemoteWindowSocket *>() << viewer))
+        return false;
+
+    QTest::qWait(WINDOW_UPDATE_DURATION);
+    metrics = server.metrics();
+    return metrics.encodeTime.count() > 0;
+}
+
+bool RemoteWindowBenchmark::runLoopback(int clientCount, bool painting, LoopbackResult &result)
+{
+    const qint64 memoryBefore = residentMemory();
+    QWindow window;
+    RemoteWindowServer server(&window, nullptr, 0);
+    const QList<QPixmap> frames = syntheticFrames(LOOPBACK_SIZE);
+    int nextFrame = 0;
+
+    window.resize(LOOPBACK_SIZE);
+    server.setScreenShotFunction([&frames, &nextFrame](QWindow *) { return frames.at(nextFrame++ % frames.count()); });
+    server.setWindowUpdateDelay(WINDOW_UPDATE_DELAY);
+    if(!server.start())
+        return false;
+
+    // Declared after the server, so the viewers are gone before it is
+    QObject viewers;
+    QList<RemoteWindowSocket *> sockets;
+    QVector<qint64> latencies;
+
+    for(int i = 0; i < clientCount; ++i) {
+        RemoteWindowSocket *socket = createViewer(&viewers, painting);
+
+        QObject::connect(socket, &RemoteWindowSocket::frameAcknowledged, [&latencies](quint32, qint64 latency) {
+            latencies.append(latency);
+        });
+        socket->connectToHost(QHostAddress::LocalHost, server.serverPort());
+        sockets.append(socket);
+    }
+    if(!waitForJoined(sockets))
+        return false;
+
+    // Only what happens once everybody is in counts, joining is not what this measures
+    quint64 framesBefore = 0;
+    quint64 bytesBefore = 0;
+    for(RemoteWindowSocket *socket : sockets) {
+        framesBefore += socket->metrics().framesReceived;
+        bytesBefore += socket->metrics().bytesReceived;
+    }
+    latencies.clear();
+
+    QElapsedTimer timer;
+    timer.start();
+    QTest::qWait(LOOPBACK_DURATION);
+
+    const qint64 elapsed = timer.elapsed();
+    quint64 framesAfter = 0;
+    quint64 bytesAfter = 0;
+    for(RemoteWindowSocket *socket : sockets) {
+        framesAfter += socket->metrics().framesReceived;
+        bytesAfter += socket->metrics().bytesReceived;
+    }
+
+    result.frameRate = (framesAfter - framesBefore) * 1000.0 / elapsed / clientCount;
+    result.latency = percentile(latencies, 0.5);
+    result.memory = memoryBefore < 0 ? -1 : residentMemory() - memoryBefore;
+    result.throughput = (bytesAfter - bytesBefore) * 1000.0 / elapsed;
+    return true;
+}
+
+bool RemoteWindowBenchmark::loopbackResult(int clientCount, bool painting, LoopbackResult &result)
+{
+    // Every figure of a run comes from the same run, it is only done once per kind of viewer and count
+    const QPair<int, bool> key(clientCount, painting);
+
+    if(!loopbackResults_.contains(key)) {
+        LoopbackResult run;
+
+        if(!runLoopback(clientCount, painting, run))
+            return false;
+        loopbackResults_.insert(key, run);
+    }
+    result = loopbackResults_.value(key);
+    return true;
+}
+
+void RemoteWindowBenchmark::messageThroughput_data()
+{
+    QTest::addColumn<int>("size");
+
+    QTest::newRow("1 KiB") << 1024;
+    QTest::newRow("64 KiB") << 64 * 1024;
+    QTest::newRow("1 MiB") << 1024 * 1024;
+}
+
+void RemoteWindowBenchmark::messageThroughput()
+{
+    // A batch of messages framed, written, read and parsed, over a real TCP connection on loopback
+    QFETCH(int, size);
+
+    LoopbackServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    RemoteWindowSocket client;
+    client.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    QVERIFY(QTest::qWaitFor([&server]() { return nullptr != server.socket; }, WAIT_TIMEOUT));
+    QVERIFY(waitForJoined(QList<RemoteWindowSocket *>() << &client << server.socket));
+
+    const QString message(size / 2, QChar('x')); // UTF-16 on the wire
+    int received = 0;
+
+    QObject::connect(&client, &RemoteWindowSocket::chatMessageReceived, [&received](const QString &) { received++; });
+    QBENCHMARK {
+        const int expected = received + MESSAGE_BATCH_SIZE;
+
+        for(int i = 0; i < MESSAGE_BATCH_SIZE; ++i)
+            server.socket->sendChatMessage(message);
+        QVERIFY(QTest::qWaitFor([&received, expected]() { return received >= expected; }, WAIT_TIMEOUT));
+    }
+}
+
+void RemoteWindowBenchmark::windowUpdate_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::addColumn<double>("quality");
+
+    const QList<QSize> sizes = QList<QSize>() << QSize(640, 480) << QSize(1280, 720) << QSize(1920, 1080) << QSize(3840, 2160);
+    const QList<double> qualities = QList<double>() << 0.3 << 0.6 << 0.9;
+
+    for(const QSize &size : sizes) {
+        for(double quality : qualities) {
+            const QString tag = QString("%1x%2 quality %3").arg(size.width()).arg(size.height()).arg(quality);
+            QTest::newRow(qPrintable(tag)) << size << quality;
+        }
+    }
+}
+
+void RemoteWindowBenchmark::windowUpdate()
+{
+    // What a window update costs per frame, the grab on the GUI thread plus the encode for the viewer
+    QFETCH(QSize, size);
+    QFETCH(double, quality);
+
+    RemoteWindowServer::Metrics metrics;
+    QVERIFY(runWindowUpdates(size, quality, 0, metrics));
+    QTest::setBenchmarkResult((metrics.captureTime.mean() + metrics.encodeTime.mean()) / 1000.0, QTest::WalltimeMilliseconds);
+}
+
+void RemoteWindowBenchmark::encoderScaling_data()
+{
+    QTest::addColumn<int>("threads");
+
+    QTest::newRow("1 thread") << 1;
+    QTest::newRow("2 threads") << 2;
+    QTest::newRow("4 threads") << 4;
+    QTest::newRow(qPrintable(QString("%1 threads, all cores").arg(QThread::idealThreadCount()))) << QThread::idealThreadCount();
+}
+
+void RemoteWindowBenchmark::encoderScaling()
+{
+    // Encode time per frame against the size of the encoder's pool. Key frames go out as bands, which
+    // are what spreads over the cores, so this shows how far that gets on this machine.
+    QFETCH(int, threads);
+
+    RemoteWindowServer::Metrics metrics;
+    QVERIFY(runWindowUpdates(SCALING_SIZE, QUALITY_DEFAULT, threads, metrics));
+    QTest::setBenchmarkResult(metrics.encodeTime.mean() / 1000.0, QTest::WalltimeMilliseconds);
+}
+
+void RemoteWindowBenchmark::loopbackFrameRate_data()
+{
+    QTest::addColumn<int>("clients");
+
+    QTest::newRow("1 client") << 1;
+    QTest::newRow("4 clients") << 4;
+    QTest::newRow("16 clients") << 16;
+}
+
+void RemoteWindowBenchmark::loopbackFrameRate()
+{
+    // Frames each viewer received per second, the server asks for one every WINDOW_UPDATE_DELAY
+    QFETCH(int, clients);
+
+    LoopbackResult result;
+    QVERIFY(loopbackResult(clients, true, result));
+    QTest::setBenchmarkResult(result.frameRate, QTest::FramesPerSecond);
+}
+
+void RemoteWindowBenchmark::loopbackLatency_data()
+{
+    loopbackFrameRate_data();
+}
+
+void RemoteWindowBenchmark::loopbackLatency()
+{
+    // Median from capture until the viewer showed the frame, as acknowledged back to the server
+    QFETCH(int, clients);
+
+    LoopbackResult result;
+    QVERIFY(loopbackResult(clients, true, result));
+    QVERIFY(result.latency >= 0);
+    QTest::setBenchmarkResult(result.latency / 1000.0, QTest::WalltimeMilliseconds);
+}
+
+void RemoteWindowBenchmark::fanOutMemory_data()
+{
+    QTest::addColumn<int>("clients");
+
+    QTest::newRow("1 client") << 1;
+    QTest::newRow("10 clients") << 10;
+    QTest::newRow("100 clients") << 100;
+}
+
+void RemoteWindowBenchmark::fanOutMemory()
+{
+    // What the whole process grew by serving the viewers. Frames are shared by every socket they go to,
+    // so this should grow with the number of connections, not with the number of frame copies.
+    QFETCH(int, clients);
+
+    LoopbackResult result;
+    QVERIFY(loopbackResult(clients, false, result));
+    if(result.memory < 0)
+        QSKIP("The resident set size can't be read on this system");
+    QTest::setBenchmarkResult(result.memory, QTest::BytesAllocated);
+}
+
+void RemoteWindowBenchmark::fanOutThroughput_data()
+{
+    fanOutMemory_data();
+}
+
+void RemoteWindowBenchmark::fanOutThroughput()
+{
+    // Frame bytes all viewers together received per second
+    QFETCH(int, clients);
+
+    LoopbackResult result;
+    QVERIFY(loopbackResult(clients, false, result));
+    QTest::setBenchmarkResult(result.throughput, QTest::BytesPerSecond);
+}
+
+void RemoteWindowBenchmark::codecEncode_data()
+{
+    // JPEG+zlib is what legacy peers get and what the lossless codec has to beat on UI content
+    QTest::addColumn<int>("codec");
+
+    QTest::newRow("qoi") << static_cast<int>(RemoteWindowCodec::CI_QOI);
+    QTest::newRow("jpeg+zlib") << static_cast<int>(RemoteWindowCodec::CI_JPEG_ZLIB);
+    QTest::newRow("jpeg") << static_cast<int>(RemoteWindowCodec::CI_JPEG);
+    QTest::newRow("png") << static_cast<int>(RemoteWindowCodec::CI_PNG);
+    QTest::newRow("raw lz4") << static_cast<int>(RemoteWindowCodec::CI_RAW_LZ4);
+}
+
+void RemoteWindowBenchmark::codecEncode()
+{
+    QFETCH(int, codec);
+
+    const RemoteWindowCodec *encoder = RemoteWindowCodec::codec(static_cast<quint8>(codec));
+    const QImage image = uiImage(CODEC_SIZE, 0);
+    QByteArray data;
+
+    QVERIFY(nullptr != encoder);
+    QBENCHMARK {
+        encoder->encodeInto(image, QUALITY_DEFAULT, data);
+    }
+    QVERIFY(!data.isEmpty());
+}
+
+void RemoteWindowBenchmark::codecDecode_data()
+{
+    codecEncode_data();
+}
+
+void RemoteWindowBenchmark::codecDecode()
+{
+    QFETCH(int, codec);
+
+    const RemoteWindowCodec *decoder = RemoteWindowCodec::codec(static_cast<quint8>(codec));
+    QVERIFY(nullptr != decoder);
+
+    const QByteArray data = decoder->encode(uiImage(CODEC_SIZE, 0), QUALITY_DEFAULT);
+    QImage image;
+
+    QBENCHMARK {
+        image = decoder->decode(data);
+    }
+    QCOMPARE(image.size(), CODEC_SIZE);
+}
+
+void RemoteWindowBenchmark::codecSize_data()
+{
+    codecEncode_data();
+}
+
+void RemoteWindowBenchmark::codecSize()
+{
+    // The compressed size per thousand bytes of raw RGB32 pixels, averaged over the synthetic frames.
+    // Lower is better, the ratio between two rows is how much smaller one codec's frames are.
+    QFETCH(int, codec);
+
+    const RemoteWindowCodec *encoder = RemoteWindowCodec::codec(static_cast<quint8>(codec));
+    QVERIFY(nullptr != encoder);
+
+    qint64 compressed = 0;
+    qint64 raw = 0;
+    for(int i = 0; i < SYNTHETIC_FRAME_COUNT; ++i) {
+        const QImage image = uiImage(CODEC_SIZE, i);
+
+        compressed += encoder->encode(image, QUALITY_DEFAULT).size();
+        raw += static_cast<qint64>(image.bytesPerLine()) * image.height();
+    }
+    QTest::setBenchmarkResult(compressed * 1000.0 / raw, QTest::Events);
+}
+
+int main(int argc, char *argv[])
+{
+    // No display needed, the server only grabs through the synthetic screen shot function
+    if(!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication app(argc, argv);
+    RemoteWindowBenchmark benchmark;
+
+    return QTest::qExec(&benchmark, argc, argv);
+}
+
+#include "tst_remotewindowbenchmark.moc"
@@ -0,0 +1,303 @@
+#include "remotewindowsocket.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTextStream>
+#include <QTimer>
+#include <QVector>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+
+// Headless viewers for sizing a host: opens any number of sessions against a server, optionally replays
+// scripted input and reads as slow as asked, then reports what every viewer got.
+
+namespace
+{
+
+struct ScriptStep
+{
+    int delay; // In ms, after the previous step
+    QString command;
+    Qt::MouseButton button;
+    QPoint position;
+    Qt::Key key;
+};
+
+struct LoadClient
+{
+    RemoteWindowSocket *socket;
+    QVector<qint64> latencies; // In us, from capture until shown
+    qint64 joinTime; // In ms, since the start of the run
+};
+
+Qt::MouseButton parseButton(const QString &name)
+{
+    if("left" == name)
+        return Qt::LeftButton;
+    if("right" == name)
+        return Qt::RightButton;
+    if("middle" == name)
+        return Qt::MiddleButton;
+    return Qt::NoButton;
+}
+
+// One step per line: "<delay ms> move <x> <y>", "<delay ms> press|release|click <left|right|middle> <x> <y>"
+// or "<delay ms> key <character or Qt::Key value>". Empty lines and lines starting with # are skipped.
+bool loadScript(const QString &fileName, QList<ScriptStep> &script)
+{
+    QFile file(fileName);
+
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QTextStream stream(&file);
+    while(!stream.atEnd()) {
+        const QString line = stream.readLine().trimmed();
+        if(line.isEmpty() || line.startsWith('#'))
+            continue;
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+        const QStringList fields = line.split(' ', Qt::SkipEmptyParts);
+#else
+        const QStringList fields = line.split(' ', QString::SkipEmptyParts);
+#endif
+        ScriptStep step;
+        bool ok = fields.count() >= 3;
+
+        if(ok)
+            step.delay = fields.at(0).toInt(&ok);
+        if(!ok || step.delay < 0)
+            return false;
+
+        step.command = fields.at(1);
+        step.button = Qt::NoButton;
+        step.key = Qt::Key_unknown;
+        if("move" == step.command && 4 == fields.count())
+            step.position = QPoint(fields.at(2).toInt(), fields.at(3).toInt());
+        else if(("press" == step.command || "release" == step.command || "click" == step.command) && 5 == fields.count()) {
+            step.button = parseButton(fields.at(2));
+            step.position = QPoint(fields.at(3).toInt(), fields.at(4).toInt());
+            if(Qt::NoButton == step.button)
+                return false;
+        } else if("key" == step.command && 3 == fields.count()) {
+            const QString key = fields.at(2);
+            step.key = static_cast<Qt::Key>(1 == key.length() ? key.at(0).toUpper().unicode() : key.toInt());
+        } else
+            return false;
+        script.append(step);
+    }
+    return !script.isEmpty();
+}
+
+void replayStep(RemoteWindowSocket *socket, const ScriptStep &step)
+{
+    if("move" == step.command)
+        socket->sendMouseMove(step.position);
+    else if("press" == step.command)
+        socket->sendMousePress(step.button, step.position);
+    else if("release" == step.command)
+        socket->sendMouseRelease(step.button, step.position);
+    else if("click" == step.command)
+        socket->sendMouseClick(step.button, step.position);
+    else if("key" == step.command) {
+        socket->sendKeyPress(step.key);
+        socket->sendKeyRelease(step.key);
+    }
+}
+
+// User plus system time of a process in clock ticks, -1 if it can't be read. Linux only.
+qint64 processCpuTime(qint64 pid)
+{
+    QFile file(QString("/proc/%1/stat").arg(pid));
+
+    if(!file.open(QIODevice::ReadOnly))
+        return -1;
+
+    // The command name may contain spaces, so count the fields from its closing parenthesis. The first field
+    // after it is the state (3), utime (14) and stime (15) follow.
+    const QByteArray stat = file.readAll();
+    const int end = stat.lastIndexOf(')');
+    if(end < 0)
+        return -1;
+
+    const QList<QByteArray> fields = stat.mid(end + 2).split(' ');
+    if(fields.count() < 13)
+        return -1;
+    return fields.at(11).toLongLong() + fields.at(12).toLongLong();
+}
+
+qint64 percentile(QVector<qint64> samples, double p)
+{
+    if(samples.isEmpty())
+        return -1;
+
+    const int index = qMin(samples.count() - 1, static_cast<int>(p * samples.count()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples.at(index);
+}
+
+QJsonObject latencyJson(const QVector<qint64> &samples)
+{
+    QJsonObject json;
+
+    json["samples"] = samples.count();
+    json["p50"] = percentile(samples, 0.5);
+    json["p90"] = percentile(samples, 0.9);
+    json["p99"] = percentile(samples, 0.99);
+    return json;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    QCommandLineOption hostOption("host", "Server address.", "address", "127.0.0.1");
+    QCommandLineOption portOption("port", "Server port.", "port", "55555");
+    QCommandLineOption clientsOption("clients", "Number of viewers.", "count", "1");
+    QCommandLineOption durationOption("duration", "Length of the run.", "seconds", "10");
+    QCommandLineOption readRateOption("read-rate", "Read at most this fast per viewer, 0 reads as fast as possible.", "bytes/s", "0");
+    QCommandLineOption scriptOption("script", "Input to replay on every viewer, in a loop.", "file");
+    QCommandLineOption codecOption("codec", "Codec id to ask for.", "id");
+    QCommandLineOption deltaOption("delta", "Ask for delta frames, viewers then compose every frame.");
+    QCommandLineOption datagramsOption("datagrams", "Ask for frames over UDP.");
+    QCommandLineOption viewportOption("viewport", "Ask for frames scaled down to fit this size.", "widthxheight");
+    QCommandLineOption qualityOption("quality", "Ask for at most this quality, between 0.0 and 1.0.", "quality");
+    QCommandLineOption lossOption("loss", "Fraction of datagrams to drop, with --datagrams.", "rate", "0");
+    QCommandLineOption serverPidOption("server-pid", "Report the CPU use of this process, the server on this host.", "pid");
+    QCommandLineOption jsonOption("json", "Report as JSON.");
+
+    parser.setApplicationDescription("Simulates viewers against a remote window server and reports the frame rate and latency each got.");
+    parser.addHelpOption();
+    parser.addOptions({ hostOption, portOption, clientsOption, durationOption, readRateOption, scriptOption, codecOption,
+                        deltaOption, datagramsOption, viewportOption, qualityOption, lossOption, serverPidOption, jsonOption });
+    parser.process(app);
+
+    QList<ScriptStep> script;
+    if(parser.isSet(scriptOption) && !loadScript(parser.value(scriptOption), script)) {
+        fprintf(stderr, "Can't read script %s\n", qPrintable(parser.value(scriptOption)));
+        return 1;
+    }
+
+    const int clientCount = qMax(parser.value(clientsOption).toInt(), 1);
+    const int duration = qMax(parser.value(durationOption).toInt(), 1);
+    const qint64 serverPid = parser.value(serverPidOption).toLongLong();
+    const QStringList viewport = parser.value(viewportOption).split('x');
+    const QSize viewportSize = 2 == viewport.count() ? QSize(viewport.at(0).toInt(), viewport.at(1).toInt()) : QSize();
+    QList<LoadClient *> clients;
+    QElapsedTimer clock;
+
+    clock.start();
+    for(int i = 0; i < clientCount; ++i) {
+        LoadClient *client = new LoadClient();
+        RemoteWindowSocket *socket = new RemoteWindowSocket(&app);
+        RemoteWindowSocket::SessionFeatures features = socket->requestedFeatures();
+
+        features.setFlag(RemoteWindowSocket::SF_DELTA_FRAMES, parser.isSet(deltaOption));
+        features.setFlag(RemoteWindowSocket::SF_DATAGRAM_FRAMES, parser.isSet(datagramsOption));
+        socket->setRequestedFeatures(features);
+        if(parser.isSet(codecOption))
+            socket->setPreferredCodecs(QList<quint8>() << static_cast<quint8>(parser.value(codecOption).toUInt()));
+        socket->setReadRate(parser.value(readRateOption).toLongLong());
+        socket->setViewportSize(viewportSize);
+        if(parser.isSet(qualityOption))
+            socket->setPreferredQuality(parser.value(qualityOption).toDouble());
+        socket->setDatagramLossRate(parser.value(lossOption).toDouble());
+
+        client->socket = socket;
+        client->joinTime = -1;
+        QObject::connect(socket, &RemoteWindowSocket::sessionStateChanged, [client, &clock]() {
+            if(RemoteWindowSocket::SS_JOINED == client->socket->sessionState() && client->joinTime < 0)
+                client->joinTime = clock.elapsed();
+        });
+        QObject::connect(socket, &RemoteWindowSocket::frameAcknowledged, [client](quint32, qint64 latency) {
+            client->latencies.append(latency);
+        });
+        socket->connectToHost(parser.value(hostOption), static_cast<quint16>(parser.value(portOption).toUInt()));
+        clients.append(client);
+    }
+
+    QTimer scriptTimer;
+    int scriptStep = 0;
+
+    scriptTimer.setSingleShot(true);
+    QObject::connect(&scriptTimer, &QTimer::timeout, [&]() {
+        for(LoadClient *client : clients) {
+            if(RemoteWindowSocket::SS_JOINED == client->socket->sessionState())
+                replayStep(client->socket, script.at(scriptStep));
+        }
+        scriptStep = (scriptStep + 1) % script.count();
+        scriptTimer.start(script.at(scriptStep).delay);
+    });
+    if(!script.isEmpty())
+        scriptTimer.start(script.first().delay);
+
+    const qint64 cpuStart = serverPid > 0 ? processCpuTime(serverPid) : -1;
+    QTimer::singleShot(duration * 1000, &app, &QCoreApplication::quit);
+    app.exec();
+
+    const qint64 elapsed = clock.elapsed();
+    const qint64 cpuEnd = serverPid > 0 ? processCpuTime(serverPid) : -1;
+    QJsonObject report;
+    QJsonArray clientReports;
+    QVector<qint64> latencies;
+    double totalFrameRate = 0.0;
+    int joined = 0;
+
+    for(int i = 0; i < clients.count(); ++i) {
+        const LoadClient *client = clients.at(i);
+        const RemoteWindowSocket::Metrics metrics = client->socket->metrics();
+        const qint64 sessionTime = client->joinTime < 0 ? 0 : elapsed - client->joinTime;
+        const double frameRate = sessionTime > 0 ? metrics.framesReceived * 1000.0 / sessionTime : 0.0;
+        QJsonObject clientReport = latencyJson(client->latencies);
+
+        clientReport["joined"] = client->joinTime >= 0;
+        clientReport["frameRate"] = frameRate;
+        clientReport["framesReceived"] = static_cast<qint64>(metrics.framesReceived);
+        clientReport["framesDropped"] = static_cast<qint64>(metrics.framesDropped);
+        clientReport["decodesSkipped"] = static_cast<qint64>(metrics.decodesSkipped);
+        clientReport["bytesReceived"] = static_cast<qint64>(metrics.bytesReceived);
+        clientReport["roundTripTime"] = metrics.roundTripTime;
+        clientReports.append(clientReport);
+
+        latencies += client->latencies;
+        totalFrameRate += frameRate;
+        if(client->joinTime >= 0)
+            joined++;
+    }
+
+    report["clients"] = clientReports;
+    report["joined"] = joined;
+    report["frameRate"] = totalFrameRate;
+    report["latency"] = latencyJson(latencies);
+    if(cpuStart >= 0 && cpuEnd >= 0)
+        report["serverCpu"] = (cpuEnd - cpuStart) * 100.0 / sysconf(_SC_CLK_TCK) / (elapsed / 1000.0); // In % of one core
+
+    if(parser.isSet(jsonOption))
+        printf("%s\n", QJsonDocument(report).toJson(QJsonDocument::Indented).constData());
+    else {
+        for(int i = 0; i < clientReports.count(); ++i) {
+            const QJsonObject clientReport = clientReports.at(i).toObject();
+            printf("client %d: %s, %.1f fps, latency p50 %.1f ms p90 %.1f ms p99 %.1f ms, %lld frames dropped, %lld decodes skipped\n",
+                   i, clientReport["joined"].toBool() ? "joined" : "not joined", clientReport["frameRate"].toDouble(),
+                   clientReport["p50"].toDouble() / 1000.0, clientReport["p90"].toDouble() / 1000.0, clientReport["p99"].toDouble() / 1000.0,
+                   static_cast<long long>(clientReport["framesDropped"].toDouble()), static_cast<long long>(clientReport["decodesSkipped"].toDouble()));
+        }
+        printf("%d of %d joined, %.1f fps in total, latency p50 %.1f ms p90 %.1f ms p99 %.1f ms\n", joined, clients.count(), totalFrameRate,
+               percentile(latencies, 0.5) / 1000.0, percentile(latencies, 0.9) / 1000.0, percentile(latencies, 0.99) / 1000.0);
+        if(report.contains("serverCpu"))
+            printf("server cpu %.1f%% of one core\n", report["serverCpu"].toDouble());
+    }
+
+    // The sockets go first, their teardown still emits into the client they report to
+    for(LoadClient *client : clients)
+        delete client->socket;
+    qDeleteAll(clients);
+    return 0;
+}
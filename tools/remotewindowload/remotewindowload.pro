@@ -0,0 +1,16 @@
+QT += gui testlib network concurrent
+
+TEMPLATE = app
+TARGET = remotewindowload
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# Links against the library built from the repository root, qt-remote-window.pro builds it first
+INCLUDEPATH += $$PWD/../..
+LIBS += -L$$OUT_PWD/../.. -lqt-remote-window-lib
+PRE_TARGETDEPS += $$OUT_PWD/../../libqt-remote-window-lib.a
+
+SOURCES += \
+    main.cpp